@@ -0,0 +1,316 @@
+.intel_syntax noprefix
+.text
+unsigned_parts:
+    push rbp
+    mov rbp, rsp
+    sub rsp, 64
+    mov qword ptr [rbp - 64], r12
+    mov r12d, edi
+    mov eax, r12d
+    mov rbx, rax
+    mov rcx, 2635249153387078803
+    mul rcx
+    mov rax, rdx
+    mov dword ptr [rbp - 16], eax
+    mov eax, r12d
+    mov rbx, rax
+    mov rcx, 2635249153387078803
+    mul rcx
+    mov rax, rdx
+    imul rax, rax, 7
+    sub rbx, rax
+    mov dword ptr [rbp - 24], ebx
+    mov eax, r12d
+    mov rbx, rax
+    shr rax, 4
+    mov dword ptr [rbp - 32], eax
+    movsxd rbx, r12d
+    mov qword ptr [rbp - 48], rbx
+    mov rax, rbx
+    mov rbx, rax
+    mov rcx, rax
+    sar rcx, 63
+    shr rcx, 60
+    add rax, rcx
+    sar rax, 4
+    mov qword ptr [rbp - 56], rax
+    mov ebx, dword ptr [rbp - 56]
+    mov dword ptr [rbp - 40], ebx
+    movabs rdi, offset .str_0
+    mov esi, r12d
+    mov edx, dword ptr [rbp - 16]
+    mov ecx, dword ptr [rbp - 24]
+    mov r8d, dword ptr [rbp - 32]
+    mov al, 0
+    call printf
+    movabs rdi, offset .str_1
+    mov esi, r12d
+    mov edx, dword ptr [rbp - 40]
+    mov al, 0
+    call printf
+    xor rax, rax
+    mov r12, qword ptr [rbp - 64]
+    mov rsp, rbp
+    pop rbp
+    ret
+narrow_parts:
+    push rbp
+    mov rbp, rsp
+    sub rsp, 48
+    mov qword ptr [rbp - 40], r12
+    mov r12b, dil
+    movsx bx, r12b
+    mov word ptr [rbp - 7], bx
+    movzx eax, bx
+    mov rbx, rax
+    mov rcx, 2635249153387078803
+    mul rcx
+    mov rax, rdx
+    mov word ptr [rbp - 5], ax
+    movsx bx, r12b
+    mov word ptr [rbp - 13], bx
+    movzx eax, bx
+    mov rbx, rax
+    mov rcx, 2635249153387078803
+    mul rcx
+    mov rax, rdx
+    imul rax, rax, 7
+    sub rbx, rax
+    mov word ptr [rbp - 11], bx
+    movsx ebx, r12b
+    mov dword ptr [rbp - 19], ebx
+    movzx ebx, word ptr [rbp - 5]
+    mov dword ptr [rbp - 23], ebx
+    movzx ebx, word ptr [rbp - 11]
+    mov dword ptr [rbp - 27], ebx
+    movabs rdi, offset .str_2
+    mov esi, dword ptr [rbp - 19]
+    mov edx, dword ptr [rbp - 23]
+    mov ecx, dword ptr [rbp - 27]
+    mov al, 0
+    call printf
+    xor rax, rax
+    mov r12, qword ptr [rbp - 40]
+    mov rsp, rbp
+    pop rbp
+    ret
+.globl main
+main:
+    push rbp
+    mov rbp, rsp
+    sub rsp, 272
+    mov qword ptr [rbp - 240], r12
+    mov qword ptr [rbp - 248], r13
+    mov qword ptr [rbp - 256], r14
+    mov qword ptr [rbp - 264], r15
+    mov rbx, 9876543210
+    mov qword ptr [rbp - 8], rbx
+    mov r14, rbx
+    mov r15d, 1
+    mov rbx, qword ptr [rbp - 8]
+    cmp rbx, 10
+    jb .in_7
+.in_8:
+    mov rax, r14
+    mov rbx, rax
+    mov rcx, -7378697629483820646
+    mul rcx
+    mov rax, rbx
+    sub rax, rdx
+    shr rax, 1
+    add rax, rdx
+    shr rax, 3
+    mov r14, rax
+    mov rbx, r15
+    add rbx, 1
+    mov r15, rbx
+    mov rbx, r14
+    cmp rbx, 10
+    jae .in_8
+.in_7:
+    mov rbx, qword ptr [rbp - 8]
+    mov r12, rbx
+    mov qword ptr [rbp - 145], 0
+    mov rbx, qword ptr [rbp - 8]
+    cmp rbx, 0
+    jz .in_10
+.in_11:
+    mov rax, r12
+    mov rbx, rax
+    mov rcx, -3689348814741910323
+    imul rcx
+    mov rax, rdx
+    add rax, rbx
+    sar rax, 3
+    mov rcx, rbx
+    sar rcx, 63
+    sub rax, rcx
+    imul rax, rax, 10
+    sub rbx, rax
+    mov qword ptr [rbp - 154], rbx
+    mov rbx, qword ptr [rbp - 145]
+    add rbx, qword ptr [rbp - 154]
+    mov qword ptr [rbp - 145], rbx
+    mov rax, r12
+    mov rbx, rax
+    mov rcx, -3689348814741910323
+    imul rcx
+    mov rax, rdx
+    add rax, rbx
+    sar rax, 3
+    mov rcx, rbx
+    sar rcx, 63
+    sub rax, rcx
+    mov r12, rax
+    mov rbx, r12
+    cmp rbx, 0
+    jnz .in_11
+.in_10:
+    mov r13, -12345
+    mov qword ptr [rbp - 194], 0
+    mov al, 1
+    test al, al
+    jz .in_13
+.in_14:
+    mov rax, r13
+    mov rbx, rax
+    mov rcx, -3689348814741910323
+    imul rcx
+    mov rax, rdx
+    add rax, rbx
+    sar rax, 3
+    mov rcx, rbx
+    sar rcx, 63
+    sub rax, rcx
+    imul rax, rax, 10
+    sub rbx, rax
+    mov qword ptr [rbp - 203], rbx
+    mov rbx, qword ptr [rbp - 194]
+    add rbx, qword ptr [rbp - 203]
+    mov qword ptr [rbp - 194], rbx
+    mov rax, r13
+    mov rbx, rax
+    mov rcx, -3689348814741910323
+    imul rcx
+    mov rax, rdx
+    add rax, rbx
+    sar rax, 3
+    mov rcx, rbx
+    sar rcx, 63
+    sub rax, rcx
+    mov r13, rax
+    mov rbx, r13
+    cmp rbx, 0
+    jnz .in_14
+.in_13:
+    mov rax, qword ptr [rbp - 8]
+    mov rbx, rax
+    mov rcx, rax
+    sar rcx, 63
+    shr rcx, 60
+    add rax, rcx
+    sar rax, 4
+    sal rax, 4
+    sub rbx, rax
+    mov qword ptr [rbp - 56], rbx
+    movabs rdi, offset .str_3
+    mov rsi, qword ptr [rbp - 8]
+    mov rdx, r15
+    mov al, 0
+    call printf
+    movabs rdi, offset .str_4
+    mov rsi, qword ptr [rbp - 8]
+    mov rdx, qword ptr [rbp - 145]
+    mov al, 0
+    call printf
+    movabs rdi, offset .str_5
+    mov rsi, -12345
+    mov rdx, qword ptr [rbp - 194]
+    mov al, 0
+    call printf
+    movabs rdi, offset .str_6
+    mov rsi, qword ptr [rbp - 8]
+    mov rdx, qword ptr [rbp - 56]
+    mov al, 0
+    call printf
+    mov eax, 21
+    sub rsp, 96
+    mov byte ptr [rsp + 95], 0
+    lea rsi, [rsp + 95]
+    mov rdi, rax
+    cmp rax, 0
+    jge .in_16
+    neg rax
+.in_16:
+.in_15:
+    mov rbx, rax
+    mov rdx, -3689348814741910323
+    mul rdx
+    shr rdx, 3
+    mov rax, rdx
+    imul rdx, rdx, 10
+    sub rbx, rdx
+    add rbx, 48
+    sub rsi, 1
+    mov byte ptr [rsi], bl
+    test rax, rax
+    jnz .in_15
+    cmp rdi, 0
+    jge .in_17
+    sub rsi, 1
+    mov byte ptr [rsi], 45
+.in_17:
+    mov byte ptr [rsi - 17], 103
+    mov byte ptr [rsi - 16], 99
+    mov byte ptr [rsi - 15], 100
+    mov byte ptr [rsi - 14], 40
+    mov byte ptr [rsi - 13], 49
+    mov byte ptr [rsi - 12], 48
+    mov byte ptr [rsi - 11], 55
+    mov byte ptr [rsi - 10], 49
+    mov byte ptr [rsi - 9], 44
+    mov byte ptr [rsi - 8], 32
+    mov byte ptr [rsi - 7], 52
+    mov byte ptr [rsi - 6], 54
+    mov byte ptr [rsi - 5], 50
+    mov byte ptr [rsi - 4], 41
+    mov byte ptr [rsi - 3], 32
+    mov byte ptr [rsi - 2], 61
+    mov byte ptr [rsi - 1], 32
+    sub rsi, 17
+    mov rdi, rsi
+    call puts
+    add rsp, 96
+    mov rdi, -1
+    call unsigned_parts
+    mov rdi, -1
+    call narrow_parts
+    xor rax, rax
+    mov r12, qword ptr [rbp - 240]
+    mov r13, qword ptr [rbp - 248]
+    mov r14, qword ptr [rbp - 256]
+    mov r15, qword ptr [rbp - 264]
+    mov rsp, rbp
+    pop rbp
+    ret
+.str_0:
+    .asciz "%d as u32: / 7 = %u, %% 7 = %u, / 16 = %u\n"
+    .size .str_0, 44
+.str_1:
+    .asciz "%d / 16 = %d\n"
+    .size .str_1, 15
+.str_2:
+    .asciz "%d as u16: / 7 = %d, %% 7 = %d\n"
+    .size .str_2, 33
+.str_3:
+    .asciz "digits(%ld) = %ld\n"
+    .size .str_3, 20
+.str_4:
+    .asciz "digit_sum(%ld) = %ld\n"
+    .size .str_4, 23
+.str_5:
+    .asciz "digit_sum(%ld) = %ld\n"
+    .size .str_5, 23
+.str_6:
+    .asciz "%ld %% 16 = %ld\n"
+    .size .str_6, 18
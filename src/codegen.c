@@ -1,27 +1,185 @@
 #include "codegen.h"
 #include "compiler.h"
+#include "peephole.h"
 #include "token.h"
 #include <assert.h>
+#include <stdint.h>
 
 #define DIMENTIONS 4
 
-static const char* x86_64_linux_call_registers[X86_64_LINUX_CALL_REGISTERS_NUM][DIMENTIONS] = {
-    {"dil", "di", "edi", "rdi"},
-    {"sil", "si", "esi", "rsi"},
-    {"dl",  "dx", "edx", "rdx"},
-    {"cl",  "cx", "ecx", "rcx"},
-    {"r8b", "r8w", "r8d", "r8"},
-    {"r9b", "r9w", "r9d", "r9"}
+static const char* register_names[][DIMENTIONS] = {
+    [Rax] = {"al",  "ax",  "eax",  "rax"},
+    [Rbx] = {"bl",  "bx",  "ebx",  "rbx"},
+    [Rcx] = {"cl",  "cx",  "ecx",  "rcx"},
+    [Rdx] = {"dl",  "dx",  "edx",  "rdx"},
+    [Rsi] = {"sil", "si",  "esi",  "rsi"},
+    [Rdi] = {"dil", "di",  "edi",  "rdi"},
+    [R8]  = {"r8b", "r8w", "r8d",  "r8"},
+    [R9]  = {"r9b", "r9w", "r9d",  "r9"},
+    [R10] = {"r10b", "r10w", "r10d", "r10"},
+    [R11] = {"r11b", "r11w", "r11d", "r11"},
+    [R12] = {"r12b", "r12w", "r12d", "r12"},
+    [R13] = {"r13b", "r13w", "r13d", "r13"},
+    [R14] = {"r14b", "r14w", "r14d", "r14"},
+    [R15] = {"r15b", "r15w", "r15d", "r15"},
+    [Rsp] = {"spl", "sp",  "esp",  "rsp"},
+    [Rbp] = {"bpl", "bp",  "ebp",  "rbp"},
+    [Xmm0] = {"xmm0", "xmm0", "xmm0", "xmm0"},
+    [Xmm1] = {"xmm1", "xmm1", "xmm1", "xmm1"},
+    [Xmm2] = {"xmm2", "xmm2", "xmm2", "xmm2"},
+    [Xmm3] = {"xmm3", "xmm3", "xmm3", "xmm3"},
+    [Xmm4] = {"xmm4", "xmm4", "xmm4", "xmm4"},
+    [Xmm5] = {"xmm5", "xmm5", "xmm5", "xmm5"},
+    [Ymm0] = {"ymm0", "ymm0", "ymm0", "ymm0"},
+    [Ymm1] = {"ymm1", "ymm1", "ymm1", "ymm1"},
+    [Ymm2] = {"ymm2", "ymm2", "ymm2", "ymm2"},
+    [Ymm3] = {"ymm3", "ymm3", "ymm3", "ymm3"},
+    [Ymm4] = {"ymm4", "ymm4", "ymm4", "ymm4"},
+    [Ymm5] = {"ymm5", "ymm5", "ymm5", "ymm5"}
 };
 
-static const char* x86_64_linux_rax_registers[] = {
-    "al", "ax", "eax", "rax"
+static const Register x86_64_linux_call_registers[X86_64_LINUX_CALL_REGISTERS_NUM] = {
+    Rdi, Rsi, Rdx, Rcx, R8, R9
 };
 
-static const char* x86_64_linux_rbx_registers[] = {
-    "bl", "bx", "ebx", "rbx"
+// The caller-saved registers hold slots in a routine none of whose calls
+// changes them, the ones System V passes arguments in last. The
+// callee-saved ones survive any call, for the price of saving them
+#define CALLER_SAVED_HOMES_NUM 4
+static const Register caller_saved_homes[CALLER_SAVED_HOMES_NUM] = {
+    R10, R11, R9, R8
 };
 
+#define CALLEE_SAVED_HOMES_NUM 4
+static const Register callee_saved_homes[CALLEE_SAVED_HOMES_NUM] = {
+    R12, R13, R14, R15
+};
+
+#define REGISTER_BIT(reg) ((uint32_t)1 << (reg))
+
+// What every op uses as scratch, nothing is kept there across an op
+#define SCRATCH_REGISTERS (REGISTER_BIT(Rax) | REGISTER_BIT(Rbx) | REGISTER_BIT(Rcx) | \
+                           REGISTER_BIT(Rdx) | REGISTER_BIT(Rsi) | REGISTER_BIT(Rdi))
+
+// What a call following System V may change
+#define SYSTEM_V_CLOBBERS (SCRATCH_REGISTERS | REGISTER_BIT(R8) | REGISTER_BIT(R9) | \
+                           REGISTER_BIT(R10) | REGISTER_BIT(R11))
+
+// A slot is only worth a register when saving and restoring that register
+// costs less than the loads and stores it replaces
+#define MIN_HOME_WEIGHT 3
+
+static const char* mnemonic_names[] = {
+    [InstrMov] = "mov",
+    [InstrMovsx] = "movsx",
+    [InstrMovsxd] = "movsxd",
+    [InstrMovzx] = "movzx",
+    [InstrMovabs] = "movabs",
+    [InstrLea] = "lea",
+    [InstrAdd] = "add",
+    [InstrSub] = "sub",
+    [InstrImul] = "imul",
+    [InstrMul] = "mul",
+    [InstrIdiv] = "idiv",
+    [InstrDiv] = "div",
+    [InstrCdq] = "cdq",
+    [InstrCqo] = "cqo",
+    [InstrNeg] = "neg",
+    [InstrSal] = "sal",
+    [InstrSar] = "sar",
+    [InstrShr] = "shr",
+    [InstrAnd] = "and",
+    [InstrXor] = "xor",
+    [InstrCmp] = "cmp",
+    [InstrTest] = "test",
+    [InstrSete] = "sete",
+    [InstrSetne] = "setne",
+    [InstrSetl] = "setl",
+    [InstrSetle] = "setle",
+    [InstrSetg] = "setg",
+    [InstrSetge] = "setge",
+    [InstrSetb] = "setb",
+    [InstrSetbe] = "setbe",
+    [InstrSeta] = "seta",
+    [InstrSetae] = "setae",
+    [InstrCmovz] = "cmovz",
+    [InstrCmovnz] = "cmovnz",
+    [InstrCmovl] = "cmovl",
+    [InstrCmovle] = "cmovle",
+    [InstrCmovg] = "cmovg",
+    [InstrCmovge] = "cmovge",
+    [InstrCmovb] = "cmovb",
+    [InstrCmovbe] = "cmovbe",
+    [InstrCmova] = "cmova",
+    [InstrCmovae] = "cmovae",
+    [InstrJmp] = "jmp",
+    [InstrJz] = "jz",
+    [InstrJnz] = "jnz",
+    [InstrJl] = "jl",
+    [InstrJle] = "jle",
+    [InstrJg] = "jg",
+    [InstrJge] = "jge",
+    [InstrJb] = "jb",
+    [InstrJbe] = "jbe",
+    [InstrJa] = "ja",
+    [InstrJae] = "jae",
+    [InstrCall] = "call",
+    [InstrPush] = "push",
+    [InstrPop] = "pop",
+    [InstrRet] = "ret",
+    [InstrMovd] = "movd",
+    [InstrMovq] = "movq",
+    [InstrMovdqu] = "movdqu",
+    [InstrMovdqa] = "movdqa",
+    [InstrPxor] = "pxor",
+    [InstrPand] = "pand",
+    [InstrPandn] = "pandn",
+    [InstrPor] = "por",
+    [InstrPaddq] = "paddq",
+    [InstrPsubb] = "psubb",
+    [InstrPsubd] = "psubd",
+    [InstrPsubq] = "psubq",
+    [InstrPsadbw] = "psadbw",
+    [InstrPcmpeqb] = "pcmpeqb",
+    [InstrPcmpeqd] = "pcmpeqd",
+    [InstrPcmpgtd] = "pcmpgtd",
+    [InstrPminub] = "pminub",
+    [InstrPmaxub] = "pmaxub",
+    [InstrPminsd] = "pminsd",
+    [InstrPmaxsd] = "pmaxsd",
+    [InstrPshufd] = "pshufd",
+    [InstrPsrldq] = "psrldq",
+    [InstrPunpcklbw] = "punpcklbw",
+    [InstrPunpcklwd] = "punpcklwd",
+    [InstrPunpckldq] = "punpckldq",
+    [InstrPunpckhdq] = "punpckhdq",
+    [InstrPunpcklqdq] = "punpcklqdq",
+    [InstrVpbroadcastb] = "vpbroadcastb",
+    [InstrVpbroadcastd] = "vpbroadcastd",
+    [InstrVpbroadcastq] = "vpbroadcastq",
+    [InstrVextracti128] = "vextracti128",
+    [InstrVzeroupper] = "vzeroupper",
+};
+
+// Vectors are the 128-bit SSE2 ones unless AVX2 was asked for, which makes
+// them twice as wide and gives the SSE instructions a separate destination
+// through their VEX encoded form
+static bool use_avx2 = false;
+
+static bool is_vector_mnemonic(Mnemonic mnemonic) {
+    return mnemonic >= InstrMovd && mnemonic <= InstrVzeroupper;
+}
+
+static bool has_vex_form(Mnemonic mnemonic) {
+    return mnemonic >= InstrMovd && mnemonic <= InstrPunpcklqdq;
+}
+
+// Labels made up while lowering an op come after every label of the ops
+static size_t next_label = 0;
+
+// The string literals of the program, for the calls whose format is known
+static Arg* static_strings = NULL;
+
 static size_t round_to_next_pow2(size_t value) {
     --value;
     value |= value >> 1;
@@ -57,286 +215,470 @@ static int64_t get_qword(Arg arg) {
     return result;
 }
 
-static void append_immediate(String_Builder* out, Arg arg) {
+// Only mov takes a 64 bit immediate, everything else sign extends 32 bits
+static bool fits_imm32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static Operand immediate(Arg arg) {
     switch (arg.size) {
-        case Byte: sb_appendf(out, "%d", get_byte(arg)); break;
-        case Word: sb_appendf(out, "%d", get_word(arg)); break;
-        case DWord: sb_appendf(out, "%d", get_dword(arg)); break;
-        case QWord: sb_appendf(out, "%ld", get_qword(arg)); break;
+        case Byte: return OperandImm(get_byte(arg), Byte);
+        case Word: return OperandImm(get_word(arg), Word);
+        case DWord: return OperandImm(get_dword(arg), DWord);
+        case QWord: return OperandImm(get_qword(arg), QWord);
         default: UNREACHABLE("Invalid Arg size");
     }
 }
 
-static void append_ptr_dimension(String_Builder* out, Size size) {
-    switch (size) {
-        case Byte: sb_appendf(out, "byte"); break;
-        case Word: sb_appendf(out, "word"); break;
-        case DWord: sb_appendf(out, "dword"); break;
-        case QWord: sb_appendf(out, "qword"); break;
+static int64_t extended_value(Arg arg, bool is_signed) {
+    switch (arg.size) {
+        case Byte: return is_signed ? (int64_t)(int8_t)get_byte(arg) : (int64_t)(uint8_t)get_byte(arg);
+        case Word: return is_signed ? (int64_t)(int16_t)get_word(arg) : (int64_t)(uint16_t)get_word(arg);
+        case DWord: return is_signed ? (int64_t)(int32_t)get_dword(arg) : (int64_t)(uint32_t)get_dword(arg);
+        case QWord: return get_qword(arg);
         default: UNREACHABLE("Invalid Arg size");
     }
 }
 
-static const char* right_mov(Destination dst, Arg src, const char** reg_arg) {
-    if (dst.size <= src.size) return "mov";
+// A Value at the width of the operation, extended the way a load of it would
+// be when it is narrower and cut to its low bits when it is wider
+static Operand immediate_as(Arg arg, Size size) {
+    if (arg.size < size) return OperandImm(extended_value(arg, arg.is_signed), size);
+    arg.size = size;
+    return immediate(arg);
+}
+
+typedef struct {
+    size_t key;
+    Register value;
+} Home;
+
+// Slots of the routine being lowered that live in a register instead of
+// the frame. Nothing takes their address, so every access goes through an
+// [rbp - position] operand and swapping it for the register is enough
+static Home* homes = NULL;
+
+// How a routine takes its arguments and what a call to it may change. main,
+// exported routines and everything outside the unit follow System V. The
+// other routines can only be called from here, so they take an argument
+// right in the caller-saved register they keep it in, and a call to them
+// changes the registers they and their own callees write and nothing else.
+typedef struct {
+    size_t routine;
+    bool internal;
+    enum { Unplanned, Planning, Planned } state;
+    Home* homes;
+    Register params[X86_64_LINUX_CALL_REGISTERS_NUM];
+    uint32_t clobbers;
+} Convention;
+
+static Convention* conventions = NULL;
+static struct { char* key; size_t value; }* convention_index = NULL;
+
+static Convention* find_convention(char* name) {
+    long index = shgeti(convention_index, name);
+    return index == -1 ? NULL : &conventions[convention_index[index].value];
+}
+
+// Where the callee of the call takes its i-th argument
+static Register argument_register(Op* call, size_t i) {
+    Convention* callee = find_convention(call->routine_call.name);
+    if (callee == NULL || !callee->internal) return x86_64_linux_call_registers[i];
+    return callee->params[i];
+}
+
+// How the routine being lowered lays out its stack
+static struct {
+    size_t saved_registers; // Where the home registers are saved, below every slot
+    size_t size;            // What is subtracted from rsp
+    bool red_zone;          // No frame, the slots sit right below rsp
+    Arg* params;
+    Register* param_registers;
+    size_t prolog_at;       // The first op after the early exits taken without a frame
+    bool entered;           // Whether the prolog was emitted, until then the
+                            // parameters are still in their registers
+} frame = {0};
+
+static Operand local_operand(Operand operand) {
+    if (operand.type != MemoryOperand || operand.mem.base != Rbp || operand.mem.disp >= 0) return operand;
+    size_t position = (size_t)-operand.mem.disp;
+
+    if (!frame.entered) {
+        Arg* params = frame.params;
+        for (size_t i = 0; i < arrlenu(params); ++i) {
+            if (params[i].position == position) return OperandReg(frame.param_registers[i], operand.size);
+        }
+    }
+
+    long index = hmgeti(homes, position);
+    if (index != -1) return OperandReg(homes[index].value, operand.size);
+
+    if (frame.red_zone) operand.mem.base = Rsp;
+    return operand;
+}
+
+static void emit(Instr** out, Instr instr) {
+    for (size_t i = 0; i < ARRAY_LEN(instr.operands); ++i) instr.operands[i] = local_operand(instr.operands[i]);
+    arrpush(*out, instr);
+}
+
+static Mnemonic right_mov(Size dst_size, Arg src, Size* reg_size) {
+    if (dst_size <= src.size) return InstrMov;
 
     if (src.is_signed) {
-        if (src.size == DWord) return "movsxd";
-        return "movsx";
-    } 
+        if (src.size == DWord) return InstrMovsxd;
+        return InstrMovsx;
+    }
 
     if (src.size == DWord) {
-        *reg_arg = x86_64_linux_rbx_registers[src.size];
-        return "mov";
+        *reg_size = src.size;
+        return InstrMov;
     } else {
-        return "movzx";
+        return InstrMovzx;
     }
 }
 
-static void mov_to_register(String_Builder* out, Destination dst, Arg arg) {
-    const char* dst_reg = dst.value.reg;
+static void load_position(Instr** out, Register reg, Size size, Arg arg) {
+    Size reg_size = size;
+    Mnemonic mov_instr = right_mov(size, arg, &reg_size);
+    Size ptr_size = size <= arg.size ? size : arg.size;
+    emit(out, NewInstr(mov_instr, OperandReg(reg, reg_size), OperandLocal(arg.position, ptr_size)));
+}
 
+static void mov_to_register(Instr** out, Operand dst, Arg arg) {
     switch (arg.type) {
-        case Position: {
-            const char* reg_arg = x86_64_linux_rbx_registers[dst.size];
-            const char* mov_instr = right_mov(dst, arg, &reg_arg);
-
-            sb_appendf(out, "    %s %s, ", mov_instr, reg_arg);
-            if (dst.size <= arg.size) append_ptr_dimension(out, dst.size);
-            else append_ptr_dimension(out, arg.size);
-            sb_appendf(out, " ptr [rbp - %zu]\n", arg.position);
-        } break;
+        case Position: load_position(out, dst.reg, dst.size, arg); break;
         case Offset: {
             assert(arg.size == QWord && dst.size == QWord);
-            sb_appendf(out, "    movabs %s, offset .str_%zu\n", dst_reg, arg.position);
-        } break;
-        case ReturnVal: {
-            sb_appendf(out, "    mov %s, %s\n", dst_reg, x86_64_linux_rax_registers[dst.size]);
-        } break;
-        case Value: {
-            sb_appendf(out, "    mov %s, ", dst_reg);
-            append_immediate(out, arg);
-            sb_appendf(out, "\n");
+            emit(out, NewInstr(InstrMovabs, dst, OperandString(arg.position)));
         } break;
+        case ReturnVal: emit(out, NewInstr(InstrMov, dst, OperandReg(Rax, dst.size))); break;
+        case Value: emit(out, NewInstr(InstrMov, dst, immediate_as(arg, dst.size))); break;
         default: UNREACHABLE("Invalid Arg type");
     }
 }
 
-static void mov_to_memory(String_Builder* out, Destination dst, Arg arg) {
-    size_t dst_pos = dst.value.position;
-
+static void mov_to_memory(Instr** out, Operand dst, Arg arg) {
     switch (arg.type) {
         case Position: {
-            const char* reg_dst = x86_64_linux_rbx_registers[dst.size];
-            const char* reg_arg = reg_dst;
-            const char* mov_instr = right_mov(dst, arg, &reg_arg);
-
-            sb_appendf(out, "    %s %s, ", mov_instr, reg_arg);
-            if (dst.size <= arg.size) append_ptr_dimension(out, dst.size);
-            else append_ptr_dimension(out, arg.size);
-            sb_appendf(out, " ptr [rbp - %zu]\n", arg.position);
-
-            sb_appendf(out, "    mov ");
-            append_ptr_dimension(out, dst.size);
-            sb_appendf(out, " ptr [rbp - %zu], ", dst_pos);
-            sb_appendf(out, "%s\n", reg_dst);
+            load_position(out, Rbx, dst.size, arg);
+            emit(out, NewInstr(InstrMov, dst, OperandReg(Rbx, dst.size)));
         } break;
         case Offset: {
-            sb_appendf(out, "    movabs rax, offset .str_%zu\n", arg.position);
-            sb_appendf(out, "    mov qword ptr [rbp - %zu], rax\n", dst_pos);
-        } break;
-        case ReturnVal: {
-            const char* reg_arg = x86_64_linux_rax_registers[dst.size];
-            sb_appendf(out, "    mov ");
-            append_ptr_dimension(out, dst.size);
-            sb_appendf(out, " ptr [rbp - %zu], %s\n", dst_pos, reg_arg);
+            emit(out, NewInstr(InstrMovabs, OperandReg(Rax, QWord), OperandString(arg.position)));
+            emit(out, NewInstr(InstrMov, OperandMem(dst.mem.base, dst.mem.disp, QWord), OperandReg(Rax, QWord)));
         } break;
+        case ReturnVal: emit(out, NewInstr(InstrMov, dst, OperandReg(Rax, dst.size))); break;
         case Value: {
-            sb_appendf(out, "    mov ");
-            append_ptr_dimension(out, dst.size);
-            sb_appendf(out, " ptr [rbp - %zu], ", dst_pos);
-            append_immediate(out, arg);
-            sb_appendf(out, "\n");
+            Operand imm = immediate_as(arg, dst.size);
+            if (dst.size == QWord && !fits_imm32(imm.imm)) {
+                emit(out, NewInstr(InstrMov, OperandReg(Rbx, QWord), imm));
+                emit(out, NewInstr(InstrMov, dst, OperandReg(Rbx, QWord)));
+            } else emit(out, NewInstr(InstrMov, dst, imm));
         } break;
         default: UNREACHABLE("Invalid Arg type");
     }
 }
 
-static void mov(String_Builder* out, Destination dst, Arg arg) {
+static void mov(Instr** out, Operand dst, Arg arg) {
     switch (dst.type) {
-        case Register: mov_to_register(out, dst, arg); break;
-        case Memory: mov_to_memory(out, dst, arg); break;
+        case RegisterOperand: mov_to_register(out, dst, arg); break;
+        case MemoryOperand: mov_to_memory(out, dst, arg); break;
         default: UNREACHABLE("Invalide Destination type");
     }
 }
 
-static void routine_call_arg_value(String_Builder* out, Arg arg, size_t reg_index) {
-    const char* reg = x86_64_linux_call_registers[reg_index][arg.size];
-    sb_appendf(out, "    mov %s, ", reg);
-    append_immediate(out, arg);
-    sb_appendf(out, "\n");
-}
-
-static void routine_call_arg_position(String_Builder* out, Arg arg, size_t reg_index) {
-    const char* reg = x86_64_linux_call_registers[reg_index][arg.size];
-    sb_appendf(out, "    mov %s, ", reg);
-    append_ptr_dimension(out, arg.size);
-    sb_appendf(out, " ptr [rbp - %zu]\n", arg.position);
-}
-
-static void routine_call_arg_offset(String_Builder* out, Arg arg, size_t reg_index) {
-    assert(arg.size == QWord);
-    sb_appendf(out, "    movabs %s, offset .str_%zu\n", x86_64_linux_call_registers[reg_index][QWord], arg.position);
-}
+// What a call left in rax is only as wide as its type, the upper bits are
+// extended here like a load from memory would
+static void load_operand(Instr** out, Register reg, Size size, Arg arg) {
+    if (arg.type != ReturnVal || arg.size >= size) {
+        mov(out, OperandReg(reg, size), arg);
+        return;
+    }
 
-static void routine_call_arg_returnval(String_Builder* out, Arg arg, size_t reg_index) {
-    const char* reg = x86_64_linux_call_registers[reg_index][arg.size];
-    const char* return_reg = x86_64_linux_rax_registers[arg.size];
-    sb_appendf(out, "    mov %s, %s\n", reg, return_reg);
+    Size reg_size = size;
+    Mnemonic mov_instr = right_mov(size, arg, &reg_size);
+    emit(out, NewInstr(mov_instr, OperandReg(reg, reg_size), OperandReg(Rax, arg.size)));
 }
 
-static void routine_call(String_Builder* out, Op op) {
+static void routine_call_args(Instr** out, Op op) {
     Arg* args = op.routine_call.args;
 
     for (size_t i = 0; i < arrlenu(args); ++i) {
         Arg arg = args[i];
+        Operand reg = OperandReg(argument_register(&op, i), arg.size);
         switch (arg.type) {
-            case Value: routine_call_arg_value(out, arg, i); break;
-            case Position: routine_call_arg_position(out, arg, i); break;
-            case Offset: routine_call_arg_offset(out, arg, i); break;
-            case ReturnVal: routine_call_arg_returnval(out, arg, i); break;
+            case Value: emit(out, NewInstr(InstrMov, reg, immediate(arg))); break;
+            case Position: emit(out, NewInstr(InstrMov, reg, OperandLocal(arg.position, arg.size))); break;
+            case Offset: {
+                assert(arg.size == QWord);
+                emit(out, NewInstr(InstrMovabs, reg, OperandString(arg.position)));
+            } break;
+            case ReturnVal: emit(out, NewInstr(InstrMov, reg, OperandReg(Rax, arg.size))); break;
             default: UNREACHABLE("Invalid Arg type");
         }
     }
 
     // TODO: Support variadics
-    if (strcmp(op.routine_call.name, "printf") == 0) sb_appendf(out, "    mov al, 0\n"); 
-    sb_appendf(out, "    call %s\n", op.routine_call.name);
+    if (strcmp(op.routine_call.name, "printf") == 0) emit(out, NewInstr(InstrMov, OperandReg(Rax, Byte), OperandImm(0, Byte)));
+}
+
+static void routine_call(Instr** out, Op op) {
+    routine_call_args(out, op);
+    emit(out, NewInstr(InstrCall, OperandSymbol(op.routine_call.name)));
+}
+
+static bool is_callee_saved(Register reg) {
+    return reg >= R12 && reg <= R15;
+}
+
+static size_t saved_registers_count() {
+    size_t count = 0;
+    for (size_t i = 0; i < hmlenu(homes); ++i) count += is_callee_saved(homes[i].value);
+    return count;
+}
+
+static Operand saved_register(Register reg) {
+    return OperandLocal(frame.saved_registers + (reg - R12 + 1) * 8, QWord);
+}
+
+static void routine_teardown(Instr** out) {
+    // An early exit has no frame to undo
+    if (!frame.entered) return;
+
+    for (size_t i = 0; i < hmlenu(homes); ++i) {
+        Register reg = homes[i].value;
+        if (is_callee_saved(reg)) emit(out, NewInstr(InstrMov, OperandReg(reg, QWord), saved_register(reg)));
+    }
+
+    if (frame.red_zone) return;
+    emit(out, NewInstr(InstrMov, OperandReg(Rsp, QWord), OperandReg(Rbp, QWord)));
+    emit(out, NewInstr(InstrPop, OperandReg(Rbp, QWord)));
 }
 
-static void binary_operation_load_factor(String_Builder* out, Arg arg, const char* ins) {
-    sb_appendf(out, "    %s %s, ", ins, x86_64_linux_rbx_registers[arg.size]);
+// The arguments are loaded while the frame is still there, then the callee
+// takes over the return address of the current routine
+static void tail_call(Instr** out, Op op) {
+    routine_call_args(out, op);
+    routine_teardown(out);
+    emit(out, NewInstr(InstrJmp, OperandSymbol(op.routine_call.name)));
+}
+
+// Applies ins to rbx and arg at the width of the operation. x86 cannot
+// extend the source of an add or a cmp, so a narrower arg goes through rax
+static void binary_operation_load_factor(Instr** out, Arg arg, Size size, Mnemonic ins) {
+    if (ins == InstrMov) {
+        load_operand(out, Rbx, size, arg);
+        return;
+    }
+
+    Operand reg = OperandReg(Rbx, size);
+    Operand scratch = OperandReg(Rax, size);
 
     switch (arg.type) {
         case Value: {
-            append_immediate(out, arg);
+            Operand imm = immediate_as(arg, size);
+            if (size == QWord && !fits_imm32(imm.imm)) {
+                emit(out, NewInstr(InstrMov, scratch, imm));
+                emit(out, NewInstr(ins, reg, scratch));
+            } else emit(out, NewInstr(ins, reg, imm));
         } break;
         case Position: {
-            append_ptr_dimension(out, arg.size);
-            sb_appendf(out, " ptr [rbp - %zu]", arg.position);
+            if (arg.size >= size) {
+                emit(out, NewInstr(ins, reg, OperandLocal(arg.position, size)));
+            } else {
+                load_operand(out, Rax, size, arg);
+                emit(out, NewInstr(ins, reg, scratch));
+            }
+        } break;
+        case ReturnVal: {
+            if (arg.size < size) load_operand(out, Rax, size, arg);
+            emit(out, NewInstr(ins, reg, scratch));
         } break;
-        case ReturnVal: sb_appendf(out, "%s", x86_64_linux_rax_registers[arg.size]); break;
         default: UNREACHABLE("Invalid Arg type");
     }
-
-    sb_appendf(out, "\n");
 }
 
-static void binary_operation_load_dst(String_Builder* out, Arg dst) {
-    const char* reg = x86_64_linux_rbx_registers[dst.size];
+static void binary_operation_load_dst(Instr** out, Arg dst) {
     if (dst.type != Position) UNREACHABLE("Destination Arg can only be of the position type");
-
-    sb_appendf(out, "    mov ");
-    append_ptr_dimension(out, dst.size);
-    sb_appendf(out, " ptr [rbp - %zu], %s\n", dst.position, reg);
+    emit(out, NewInstr(InstrMov, OperandLocal(dst.position, dst.size), OperandReg(Rbx, dst.size)));
 }
 
-static void binary_operation_load_cmp_dst(String_Builder* out, Arg dst, const char* instr) {
+static void binary_operation_load_cmp_dst(Instr** out, Arg dst, Mnemonic instr) {
     if (dst.type != Position) UNREACHABLE("Destination Arg can only be of the position type");
     if (dst.size != Byte) UNREACHABLE("Destination Arg con only be of size byte");
-    sb_appendf(out, "    %s al\n", instr);
-    sb_appendf(out, "    mov byte ptr [rbp - %zu], al\n", dst.position);
+    emit(out, NewInstr(instr, OperandReg(Rax, Byte)));
+    emit(out, NewInstr(InstrMov, OperandLocal(dst.position, Byte), OperandReg(Rax, Byte)));
 }
 
-static void binary_operation_add(String_Builder* out, Op op) {
+// Only the bits that fit in the destination are kept, so an operand as wide
+// as it is used as is and a narrower one is extended with its own sign
+static void binary_operation_add(Instr** out, Op op) {
     Arg lhs = op.binop.lhs;
     Arg rhs = op.binop.rhs;
     Arg dst = op.binop.offset_dst;
 
-    binary_operation_load_factor(out, lhs, "mov");
-    binary_operation_load_factor(out, rhs, "add");
+    binary_operation_load_factor(out, lhs, dst.size, InstrMov);
+    binary_operation_load_factor(out, rhs, dst.size, InstrAdd);
     binary_operation_load_dst(out, dst);
 }
 
-static void binary_operation_sub(String_Builder* out, Op op) {
+static void binary_operation_sub(Instr** out, Op op) {
     Arg lhs = op.binop.lhs;
     Arg rhs = op.binop.rhs;
     Arg dst = op.binop.offset_dst;
 
-    binary_operation_load_factor(out, lhs, "mov");
-    binary_operation_load_factor(out, rhs, "sub");
+    binary_operation_load_factor(out, lhs, dst.size, InstrMov);
+    binary_operation_load_factor(out, rhs, dst.size, InstrSub);
     binary_operation_load_dst(out, dst);
 }
 
-static void binary_operation_mul(String_Builder* out, Op op) {
+// imul has no byte form, narrow products are computed on 32 bits
+static void binary_operation_mul(Instr** out, Op op) {
     Arg lhs = op.binop.lhs;
     Arg rhs = op.binop.rhs;
-    Arg arg_dst = op.binop.offset_dst;
+    Arg dst = op.binop.offset_dst;
+    Size size = dst.size < DWord ? DWord : dst.size;
+    Operand rbx = OperandReg(Rbx, size);
 
-    Destination dst = {
-        .type = Register,
-        .size = arg_dst.size,
-        .value.reg = x86_64_linux_rbx_registers[arg_dst.size]
-    };
+    binary_operation_load_factor(out, lhs, size, InstrMov);
 
-    mov(out, dst, lhs);
+    Operand factor = rhs.type == Value ? immediate_as(rhs, size) : (Operand) {0};
+    if (rhs.type == Value && fits_imm32(factor.imm)) emit(out, NewInstr(InstrImul, rbx, rbx, factor));
+    else binary_operation_load_factor(out, rhs, size, InstrImul);
 
-    switch (rhs.type) {
-        case Position: {
-            const char* rbx_reg = x86_64_linux_rbx_registers[rhs.size];
-            sb_appendf(out, "    imul %s, [rbp - %zu]\n", rbx_reg, rhs.position);
-            sb_appendf(out, "    mov [rbp - %zu], %s\n", arg_dst.position, rbx_reg);
-        } break;
-        case ReturnVal: {
-            const char* rbx_reg = x86_64_linux_rbx_registers[lhs.size];
-            const char* rax_reg = x86_64_linux_rax_registers[lhs.size];
-            sb_appendf(out, "    imul %s, %s\n", rbx_reg, rax_reg);
-            sb_appendf(out, "    mov [rbp - %zu], %s\n", arg_dst.position, rbx_reg);
-        } break;
-        case Value: { 
-            const char* rbx_reg = x86_64_linux_rbx_registers[lhs.size];
-            sb_appendf(out, "    imul %s, %s, ", rbx_reg, rbx_reg);
-            append_immediate(out, rhs);
-            sb_appendf(out, "\n    mov [rbp - %zu], %s\n", arg_dst.position, rbx_reg);
-        } break;
-        case Offset: UNREACHABLE("Unsupported"); break;
-        default: UNREACHABLE("Invalid Arg type");
+    binary_operation_load_dst(out, dst);
+}
+
+static Mnemonic comparison_set(BinaryOp op) {
+    switch (op) {
+        case Eq: return InstrSete;
+        case Lt: return InstrSetl;
+        case Le: return InstrSetle;
+        case Gt: return InstrSetg;
+        case Ge: return InstrSetge;
+        case ULt: return InstrSetb;
+        case ULe: return InstrSetbe;
+        case UGt: return InstrSeta;
+        case UGe: return InstrSetae;
+        case Ne: return InstrSetne;
+        default: UNREACHABLE("Not a comparison");
     }
 }
 
-static void binary_operation_cmp(String_Builder* out, Op op, const char* instr) {
-    Arg lhs = op.binop.lhs;
-    Arg rhs = op.binop.rhs;
-    Arg dst = op.binop.offset_dst;
+static Mnemonic comparison_jump(BinaryOp op) {
+    switch (op) {
+        case Eq: return InstrJz;
+        case Lt: return InstrJl;
+        case Le: return InstrJle;
+        case Gt: return InstrJg;
+        case Ge: return InstrJge;
+        case ULt: return InstrJb;
+        case ULe: return InstrJbe;
+        case UGt: return InstrJa;
+        case UGe: return InstrJae;
+        case Ne: return InstrJnz;
+        default: UNREACHABLE("Not a comparison");
+    }
+}
 
-    // TODO: support typecheking in expressions in order to always have the same size
-    // assert(lhs.size == rhs.size);
+static Mnemonic comparison_move(BinaryOp op) {
+    switch (op) {
+        case Eq: return InstrCmovz;
+        case Lt: return InstrCmovl;
+        case Le: return InstrCmovle;
+        case Gt: return InstrCmovg;
+        case Ge: return InstrCmovge;
+        case ULt: return InstrCmovb;
+        case ULe: return InstrCmovbe;
+        case UGt: return InstrCmova;
+        case UGe: return InstrCmovae;
+        case Ne: return InstrCmovnz;
+        default: UNREACHABLE("Not a comparison");
+    }
+}
 
-    binary_operation_load_factor(out, lhs, "mov");
-    binary_operation_load_factor(out, rhs, "cmp");
-    binary_operation_load_cmp_dst(out, dst, instr);
+static BinaryOp negate_comparison(BinaryOp op) {
+    switch (op) {
+        case Eq: return Ne;
+        case Lt: return Ge;
+        case Le: return Gt;
+        case Gt: return Le;
+        case Ge: return Lt;
+        case ULt: return UGe;
+        case ULe: return UGt;
+        case UGt: return ULe;
+        case UGe: return ULt;
+        case Ne: return Eq;
+        default: UNREACHABLE("Not a comparison");
+    }
 }
 
-static void binary_operation_shift(String_Builder* out, Op op) {
+static bool is_comparison(BinaryOp op) {
+    return op >= Lt && op <= Ne;
+}
+
+static bool is_unsigned_comparison(BinaryOp op) {
+    return op >= ULt && op <= UGe;
+}
+
+static bool value_fits(int64_t value, Size size, bool is_signed) {
+    int bits = 8 << size;
+    if (bits == 64) return is_signed || value >= 0;
+    if (is_signed) return value >= -((int64_t)1 << (bits - 1)) && value < ((int64_t)1 << (bits - 1));
+    return value >= 0 && value < ((int64_t)1 << bits);
+}
+
+// Whether comparing side with the constant on its own width gives the same
+// answer as extending it first: the constant has to be in the range of its
+// type and the comparison has to read the bits with the same signedness
+static bool compares_narrow(BinaryOp op, Arg side, Arg constant) {
+    if (side.type == Value || constant.type != Value || side.size >= constant.size) return false;
+    if (op != Eq && op != Ne && is_unsigned_comparison(op) == side.is_signed) return false;
+    return value_fits(extended_value(constant, constant.is_signed), side.size, side.is_signed);
+}
+
+// Both sides are extended with their own signedness to the wider of the two
+// widths, unless a constant is known to fit in the narrower one
+static Size compared_size(Op cmp) {
+    Arg lhs = cmp.binop.lhs;
+    Arg rhs = cmp.binop.rhs;
+    BinaryOp op = cmp.binop.op;
+
+    if (compares_narrow(op, lhs, rhs)) return lhs.size;
+    if (compares_narrow(op, rhs, lhs)) return rhs.size;
+    return max(lhs.size, rhs.size);
+}
+
+static void binary_operation_compare(Instr** out, Op cmp) {
+    Size size = compared_size(cmp);
+    binary_operation_load_factor(out, cmp.binop.lhs, size, InstrMov);
+    binary_operation_load_factor(out, cmp.binop.rhs, size, InstrCmp);
+}
+
+static void binary_operation_cmp(Instr** out, Op op, Mnemonic instr) {
+    binary_operation_compare(out, op);
+    binary_operation_load_cmp_dst(out, op.binop.offset_dst, instr);
+}
+
+// An unsigned lhs is shifted in zeros, and is extended with them when the
+// destination is wider. A wider lhs is shifted on its own width before it
+// is cut down, for the bits that come down from above the destination
+static void binary_operation_shift(Instr** out, Op op) {
     Arg lhs = op.binop.lhs;
     Arg rhs = op.binop.rhs;
     Arg arg_dst = op.binop.offset_dst;
 
-    const char* instr = NULL;
+    Mnemonic instr = InstrSal;
 
     switch (op.binop.op) {
-        case LSh: instr = "sal"; break;
-        case RSh: instr = "sar"; break;
+        case LSh: instr = InstrSal; break;
+        case RSh: instr = lhs.is_signed ? InstrSar : InstrShr; break;
         default: UNREACHABLE("");
     }
 
-    Destination dst = {
-        .type = Register,
-        .size = arg_dst.size,
-        .value.reg = x86_64_linux_rbx_registers[arg_dst.size]
-    };
-
-    mov(out, dst, lhs);
+    Operand rbx_reg = OperandReg(Rbx, max(lhs.size, arg_dst.size));
+    load_operand(out, Rbx, rbx_reg.size, lhs);
 
     switch (rhs.type) {
         case Position: { TODO("");
@@ -344,146 +686,1159 @@ static void binary_operation_shift(String_Builder* out, Op op) {
         case ReturnVal: { TODO("");
         } break;
         case Value: {
-            const char* rbx_reg = x86_64_linux_rbx_registers[arg_dst.size];
-            sb_appendf(out, "    %s %s, ", instr, rbx_reg);
-            append_immediate(out, rhs);
-            sb_appendf(out, "\n    mov [rbp - %zu], %s\n", arg_dst.position, rbx_reg);
+            emit(out, NewInstr(instr, rbx_reg, immediate(rhs)));
+            emit(out, NewInstr(InstrMov, OperandLocal(arg_dst.position, arg_dst.size), OperandReg(Rbx, arg_dst.size)));
         } break;
         case Offset: UNREACHABLE("Unsupported"); break;
         default: UNREACHABLE("Invalid Arg type");
     }
 }
 
-static void binary_operation(String_Builder* out, Op op) {
+static bool is_signed_division(BinaryOp op) {
+    return op == Div || op == Mod;
+}
+
+static bool is_remainder(BinaryOp op) {
+    return op == Mod || op == UMod;
+}
+
+static int ceil_log2(uint64_t value) {
+    return value > 1 ? 64 - __builtin_clzll(value - 1) : 0;
+}
+
+// Immediates wider than 32 bits only fit in a mov, so they go through rcx
+static void emit_with_immediate(Instr** out, Mnemonic mnemonic, Register reg, int64_t value) {
+    if (fits_imm32(value)) {
+        emit(out, NewInstr(mnemonic, OperandReg(reg, QWord), OperandImm(value, QWord)));
+        return;
+    }
+
+    emit(out, NewInstr(InstrMov, OperandReg(Rcx, QWord), OperandImm(value, QWord)));
+    emit(out, NewInstr(mnemonic, OperandReg(reg, QWord), OperandReg(Rcx, QWord)));
+}
+
+// div works on at least 32 bits, whatever the width of the result
+static Size division_size(Op op) {
+    Size size = op.binop.offset_dst.size;
+    return size < DWord ? DWord : size;
+}
+
+// A constant divisor as div sees it, loaded like any other operand and then
+// read on the width and with the signedness of the division
+static int64_t divisor_value(Op op) {
+    int64_t value = extended_value(op.binop.rhs, op.binop.rhs.is_signed);
+    if (division_size(op) == QWord) return value;
+    return is_signed_division(op.binop.op) ? (int64_t)(int32_t)value : (int64_t)(uint32_t)value;
+}
+
+// Whether a constant divisor can be dealt with without div, and on how many
+// bits the lhs is significant. Shifting the 64 bits of an unsigned divisor
+// too large to be a signed one is left to div
+static bool magic_divisor(Op op, uint64_t* divisor, bool* narrow) {
+    bool is_signed = is_signed_division(op.binop.op);
+    if (op.binop.rhs.type != Value) return false;
+
+    int64_t value = divisor_value(op);
+    if (value == 0 || value == INT64_MIN || (!is_signed && value < 0)) return false;
+
+    *divisor = value < 0 ? -value : value;
+    *narrow = division_size(op) == DWord;
+    return true;
+}
+
+// The quotient of x / d is left in rax with x kept in rbx. Constants use the
+// sequences from Granlund and Montgomery, "Division by Invariant Integers
+// using Multiplication": powers of two are shifts, adjusted towards zero when
+// signed, and every other divisor a multiplication by its scaled reciprocal
+static void divide_by_constant(Instr** out, bool is_signed, uint64_t d, bool narrow) {
+    Operand rax = OperandReg(Rax, QWord);
+    Operand rbx = OperandReg(Rbx, QWord);
+    Operand rcx = OperandReg(Rcx, QWord);
+    Operand rdx = OperandReg(Rdx, QWord);
+    int l = ceil_log2(d);
+
+    emit(out, NewInstr(InstrMov, rbx, rax));
+    if (d == 1) return;
+
+    if ((d & (d - 1)) == 0) {
+        if (is_signed) {
+            emit(out, NewInstr(InstrMov, rcx, rax));
+            emit(out, NewInstr(InstrSar, rcx, OperandImm(63, Byte)));
+            emit(out, NewInstr(InstrShr, rcx, OperandImm(64 - l, Byte)));
+            emit(out, NewInstr(InstrAdd, rax, rcx));
+            emit(out, NewInstr(InstrSar, rax, OperandImm(l, Byte)));
+        } else emit(out, NewInstr(InstrShr, rax, OperandImm(l, Byte)));
+        return;
+    }
+
+    // A lhs of at most 32 bits takes a 64 bit reciprocal whose product never
+    // overflows, so no correction step is needed
+    if (narrow && d > (is_signed ? (uint64_t)INT32_MAX : (uint64_t)UINT32_MAX)) {
+        emit(out, NewInstr(InstrXor, OperandReg(Rax, DWord), OperandReg(Rax, DWord)));
+        return;
+    }
+
+    if (narrow && !is_signed) {
+        uint64_t m = (uint64_t)(((unsigned __int128)1 << 64) / d) + 1;
+        emit(out, NewInstr(InstrMov, rcx, OperandImm(m, QWord)));
+        emit(out, NewInstr(InstrMul, rcx));
+        emit(out, NewInstr(InstrMov, rax, rdx));
+        return;
+    }
+
+    if (narrow) {
+        uint64_t m = (uint64_t)(((uint64_t)1 << (31 + l)) / d) + 1;
+        emit(out, NewInstr(InstrMov, rcx, OperandImm(m, QWord)));
+        emit(out, NewInstr(InstrImul, rax, rcx));
+        emit(out, NewInstr(InstrSar, rax, OperandImm(31 + l, Byte)));
+    } else if (!is_signed) {
+        uint64_t m = (uint64_t)((((unsigned __int128)(((uint64_t)1 << l) - d)) << 64) / d) + 1;
+        emit(out, NewInstr(InstrMov, rcx, OperandImm(m, QWord)));
+        emit(out, NewInstr(InstrMul, rcx));
+        emit(out, NewInstr(InstrMov, rax, rbx));
+        emit(out, NewInstr(InstrSub, rax, rdx));
+        emit(out, NewInstr(InstrShr, rax, OperandImm(1, Byte)));
+        emit(out, NewInstr(InstrAdd, rax, rdx));
+        if (l > 1) emit(out, NewInstr(InstrShr, rax, OperandImm(l - 1, Byte)));
+        return;
+    } else {
+        uint64_t m = (uint64_t)(((unsigned __int128)1 << (63 + l)) / d) + 1;
+        emit(out, NewInstr(InstrMov, rcx, OperandImm(m, QWord)));
+        emit(out, NewInstr(InstrImul, rcx));
+        emit(out, NewInstr(InstrMov, rax, rdx));
+        emit(out, NewInstr(InstrAdd, rax, rbx));
+        if (l > 1) emit(out, NewInstr(InstrSar, rax, OperandImm(l - 1, Byte)));
+    }
+
+    // Rounds the floored quotient of a negative lhs towards zero
+    emit(out, NewInstr(InstrMov, rcx, rbx));
+    emit(out, NewInstr(InstrSar, rcx, OperandImm(63, Byte)));
+    emit(out, NewInstr(InstrSub, rax, rcx));
+}
+
+static void binary_operation_div(Instr** out, Op op) {
+    Arg lhs = op.binop.lhs;
+    Arg rhs = op.binop.rhs;
+    Arg dst = op.binop.offset_dst;
+    bool is_signed = is_signed_division(op.binop.op);
+    bool remainder = is_remainder(op.binop.op);
+
+    Size size = division_size(op);
+    uint64_t d = 0;
+    bool narrow = false;
+    Register result = Rax;
+
+    if (magic_divisor(op, &d, &narrow)) {
+        int64_t divisor = divisor_value(op);
+        // The lhs is taken on as many bits as div would see, then extended
+        // to 64 by the signedness of the division rather than its own
+        load_operand(out, Rax, size, lhs);
+        if (narrow && is_signed) emit(out, NewInstr(InstrMovsxd, OperandReg(Rax, QWord), OperandReg(Rax, DWord)));
+        divide_by_constant(out, is_signed, d, narrow);
+        if (divisor < 0) emit(out, NewInstr(InstrNeg, OperandReg(Rax, QWord)));
+
+        if (remainder && !is_signed && (d & (d - 1)) == 0) {
+            emit(out, NewInstr(InstrMov, OperandReg(Rax, QWord), OperandReg(Rbx, QWord)));
+            emit_with_immediate(out, InstrAnd, Rax, d - 1);
+        } else if (remainder) {
+            // x - x / d * d
+            if (fits_imm32(divisor)) {
+                emit(out, NewInstr(InstrImul, OperandReg(Rax, QWord), OperandReg(Rax, QWord), OperandImm(divisor, QWord)));
+            } else emit_with_immediate(out, InstrImul, Rax, divisor);
+            emit(out, NewInstr(InstrSub, OperandReg(Rbx, QWord), OperandReg(Rax, QWord)));
+            result = Rbx;
+        }
+    } else {
+        // The divisor is loaded first, it may still be in rax
+        load_operand(out, Rcx, size, rhs);
+        load_operand(out, Rax, size, lhs);
+
+        if (is_signed) emit(out, NewInstr(size == QWord ? InstrCqo : InstrCdq));
+        else emit(out, NewInstr(InstrXor, OperandReg(Rdx, DWord), OperandReg(Rdx, DWord)));
+        emit(out, NewInstr(is_signed ? InstrIdiv : InstrDiv, OperandReg(Rcx, size)));
+
+        if (remainder) result = Rdx;
+    }
+
+    emit(out, NewInstr(InstrMov, OperandLocal(dst.position, dst.size), OperandReg(result, dst.size)));
+}
+
+static void binary_operation(Instr** out, Op op) {
     BinaryOp operation = op.binop.op;
 
     switch (operation) {
         case Add: binary_operation_add(out, op); break;
         case Sub: binary_operation_sub(out, op); break;
-        // TODO: these instructions are all signed 
+        // TODO: these instructions are all signed
         // https://cs.brown.edu/courses/cs033/docs/guides/x64_cheatsheet.pdf
         case Mul: binary_operation_mul(out, op); break;
-        case Eq: binary_operation_cmp(out, op, "sete"); break;
-        case Lt: binary_operation_cmp(out, op, "setl"); break;
-        case Le: binary_operation_cmp(out, op, "setle"); break;
-        case Gt: binary_operation_cmp(out, op, "setg"); break;
-        case Ge: binary_operation_cmp(out, op, "setge"); break;
-        case Ne: binary_operation_cmp(out, op, "setne"); break;
+        case Div:
+        case Mod:
+        case UDiv:
+        case UMod: binary_operation_div(out, op); break;
+        case Eq:
+        case Lt:
+        case Le:
+        case Gt:
+        case Ge:
+        case ULt:
+        case ULe:
+        case UGt:
+        case UGe:
+        case Ne: binary_operation_cmp(out, op, comparison_set(operation)); break;
         case LSh:
         case RSh: binary_operation_shift(out, op); break;
         default: TODO("Binary operation unsupported yet");
-    } 
+    }
 }
 
-static void jump_if_not(String_Builder* out, Op op) {
-    Arg arg = op.jump_if_not.arg;
-
-    const char* reg = x86_64_linux_rax_registers[arg.size];
-    sb_appendf(out, "    mov %s, ", reg);
+static void conditional_jump(Instr** out, Arg arg, size_t label, Mnemonic instr) {
+    Operand reg = OperandReg(Rax, arg.size);
 
     switch (arg.type) {
-        case Value: append_immediate(out, arg); break;
-        case Position: {
-            append_ptr_dimension(out, arg.size);
-            sb_appendf(out, " ptr [rbp - %zu]\n", arg.position);
-        } break;
+        case Value: emit(out, NewInstr(InstrMov, reg, immediate(arg))); break;
+        case Position: emit(out, NewInstr(InstrMov, reg, OperandLocal(arg.position, arg.size))); break;
         default: UNREACHABLE("Invalid Arg type");
     }
 
-    sb_appendf(out, "    test %s, %s\n", reg, reg);
-    sb_appendf(out, "    jz .in_%zu\n", op.jump_if_not.label);
+    emit(out, NewInstr(InstrTest, reg, reg));
+    emit(out, NewInstr(instr, OperandLabel(label)));
+}
+
+static void jump_if_not(Instr** out, Op op) {
+    conditional_jump(out, op.jump_if_not.arg, op.jump_if_not.label, InstrJz);
+}
+
+static void jump_if(Instr** out, Op op) {
+    conditional_jump(out, op.jump_if.arg, op.jump_if.label, InstrJnz);
+}
+
+// Whether next is a conditional jump or a select on the result of the
+// comparison cmp, which can then use the flags directly
+static bool is_fused_compare(Op cmp, Op next) {
+    if (cmp.type != Binary || !is_comparison(cmp.binop.op)) return false;
+
+    Arg dst = cmp.binop.offset_dst;
+    Arg arg = {0};
+    switch (next.type) {
+        case JumpIfNot: arg = next.jump_if_not.arg; break;
+        case JumpIf: arg = next.jump_if.arg; break;
+        case Select: {
+            // The values are loaded before the comparison result is stored
+            if (next.select.if_true.type == Position && next.select.if_true.position == dst.position) return false;
+            if (next.select.if_false.type == Position && next.select.if_false.position == dst.position) return false;
+            arg = next.select.cond;
+        } break;
+        default: return false;
+    }
+
+    return arg.type == Position && arg.position == dst.position;
+}
+
+#define MAX_OP_READS X86_64_LINUX_CALL_REGISTERS_NUM
+
+// Args an op reads, the condition of a jump or a select comes first
+static size_t op_reads(Op* op, Arg reads[MAX_OP_READS]) {
+    size_t count = 0;
+
+    switch (op->type) {
+        case RtReturn: reads[count++] = op->return_routine.ret; break;
+        case AssignLocal: reads[count++] = op->assign_loc.arg; break;
+        case RoutineCall:
+        case TailCall: {
+            for (size_t i = 0; i < arrlenu(op->routine_call.args); ++i) reads[count++] = op->routine_call.args[i];
+        } break;
+        case Binary: {
+            reads[count++] = op->binop.lhs;
+            reads[count++] = op->binop.rhs;
+        } break;
+        case Unary: reads[count++] = op->unary.arg; break;
+        case Select: {
+            reads[count++] = op->select.cond;
+            reads[count++] = op->select.if_true;
+            reads[count++] = op->select.if_false;
+        } break;
+        case Reduce: {
+            reads[count++] = op->reduce.acc;
+            reads[count++] = op->reduce.base;
+            reads[count++] = op->reduce.count;
+            reads[count++] = op->reduce.needle;
+        } break;
+        case JumpIfNot: reads[count++] = op->jump_if_not.arg; break;
+        case JumpIf: reads[count++] = op->jump_if.arg; break;
+        default: break;
+    }
+
+    return count;
+}
+
+static Arg* op_written(Op* op) {
+    switch (op->type) {
+        case AssignLocal: return &op->assign_loc.offset_dst;
+        case Binary: return &op->binop.offset_dst;
+        case Unary: return &op->unary.offset_dst;
+        case Select: return &op->select.offset_dst;
+        case Reduce: return &op->reduce.offset_dst;
+        default: return NULL;
+    }
 }
 
-static void jump(String_Builder* out, Op op) {
-    sb_appendf(out, "    jmp .in_%zu\n", op.jump.label);
+static size_t routine_end(Op* ops, size_t routine) {
+    size_t end = routine + 1;
+    while (end < arrlenu(ops) && ops[end].type != NewRoutine) end += 1;
+    return end;
 }
 
-static void label(String_Builder* out, Op op) {
-    sb_appendf(out, ".in_%zu:\n", op.label.index);
+static bool is_leaf(Op* ops, size_t routine) {
+    for (size_t i = routine + 1; i < routine_end(ops, routine); ++i) {
+        if (ops[i].type == RoutineCall || ops[i].type == TailCall) return false;
+    }
+    return true;
 }
 
-static void assign_local_value(String_Builder* out, Arg arg_dst, Arg arg) {
-    assert(arg_dst.type == Position);
+// Reads of every slot of the routine being lowered, leaving out the jumps
+// and selects that are fused with their comparison
+static struct { size_t key; size_t value; }* slot_reads = NULL;
+
+static void count_slot_reads(Op* ops, size_t routine) {
+    hmfree(slot_reads);
 
-    Destination dst = {
-        .type = Memory,
-        .size = arg_dst.size,
-        .value.position = arg_dst.position
-    };
+    for (size_t i = routine + 1; i < routine_end(ops, routine); ++i) {
+        Arg reads[MAX_OP_READS];
+        size_t count = op_reads(&ops[i], reads);
+        size_t first = is_fused_compare(ops[i - 1], ops[i]) ? 1 : 0;
 
-    mov(out, dst, arg);
+        for (size_t j = first; j < count; ++j) {
+            if (reads[j].type != Position) continue;
+            // Read before the put, which inserts the key uninitialized first
+            size_t seen = hmget(slot_reads, reads[j].position);
+            hmput(slot_reads, reads[j].position, seen + 1);
+        }
+    }
 }
 
-static void assign_local(String_Builder* out, Op op) {
+#define MAX_LOOP_DEPTH 5
+
+// How often each op runs relative to the others, a backward jump closes a
+// loop and every use inside it weighs 8 times more
+static size_t* op_weights(Op* ops, size_t routine, size_t end) {
+    struct { size_t key; size_t value; }* labels = NULL;
+    size_t* weights = NULL;
+
+    for (size_t i = routine; i < end; ++i) {
+        if (ops[i].type == Label) hmput(labels, ops[i].label.index, i);
+        arrpush(weights, 1);
+    }
+
+    for (size_t i = routine; i < end; ++i) {
+        long target = -1;
+        switch (ops[i].type) {
+            case Jump: target = hmgeti(labels, ops[i].jump.label); break;
+            case JumpIfNot: target = hmgeti(labels, ops[i].jump_if_not.label); break;
+            case JumpIf: target = hmgeti(labels, ops[i].jump_if.label); break;
+            default: break;
+        }
+        if (target == -1 || labels[target].value > i) continue;
+
+        for (size_t j = labels[target].value; j <= i; ++j) {
+            if (weights[j - routine] < ((size_t)1 << (3 * MAX_LOOP_DEPTH))) weights[j - routine] *= 8;
+        }
+    }
+
+    hmfree(labels);
+    return weights;
+}
+
+// The most used slots whose address is never taken are kept in the home
+// registers for the whole routine, first in the caller-saved ones none of
+// its calls changes
+static Home* assign_home_registers(Op* ops, size_t routine, uint32_t clobbered) {
+    struct { size_t key; size_t value; }* uses = NULL;
+    struct { size_t key; bool value; }* escaped = NULL;
+    size_t end = routine_end(ops, routine);
+    size_t* weights = op_weights(ops, routine, end);
+    Home* assigned = NULL;
+
+    for (size_t i = routine + 1; i < end; ++i) {
+        Op* op = &ops[i];
+        size_t weight = weights[i - routine];
+
+        Arg used[MAX_OP_READS + 1];
+        size_t count = op_reads(op, used);
+
+        // A condition fused with its comparison is read from the flags, and
+        // a comparison nothing else reads is never stored
+        size_t first = is_fused_compare(ops[i - 1], *op) ? 1 : 0;
+        Arg* dst = op_written(op);
+        bool in_flags = i + 1 < end && is_fused_compare(*op, ops[i + 1]) && hmget(slot_reads, dst->position) == 0;
+        if (dst && !in_flags) used[count++] = *dst;
+
+        for (size_t j = first; j < count; ++j) {
+            if (used[j].type != Position) continue;
+            size_t total = hmget(uses, used[j].position);
+            hmput(uses, used[j].position, total + weight);
+        }
+
+        if (op->type == Unary && op->unary.op == Ref) hmput(escaped, op->unary.arg.position, true);
+    }
+
+    Register candidates[CALLER_SAVED_HOMES_NUM + CALLEE_SAVED_HOMES_NUM];
+    size_t candidates_count = 0;
+    for (size_t i = 0; i < CALLER_SAVED_HOMES_NUM; ++i) {
+        if ((clobbered & REGISTER_BIT(caller_saved_homes[i])) == 0) candidates[candidates_count++] = caller_saved_homes[i];
+    }
+    for (size_t i = 0; i < CALLEE_SAVED_HOMES_NUM; ++i) candidates[candidates_count++] = callee_saved_homes[i];
+
+    while (hmlenu(assigned) < candidates_count) {
+        long best = -1;
+        for (size_t i = 0; i < hmlenu(uses); ++i) {
+            if (hmget(escaped, uses[i].key) || hmgeti(assigned, uses[i].key) != -1) continue;
+            if (uses[i].value < MIN_HOME_WEIGHT) continue;
+            if (best == -1 || uses[i].value > uses[best].value) best = i;
+        }
+
+        if (best == -1) break;
+        Register reg = candidates[hmlenu(assigned)];
+        hmput(assigned, uses[best].key, reg);
+    }
+
+    hmfree(uses);
+    hmfree(escaped);
+    arrfree(weights);
+    return assigned;
+}
+
+static uint32_t plan_convention(Op* ops, Convention* convention);
+
+// Everything System V allows, unless the callee is on the internal
+// convention: then what it writes and the registers of the arguments
+static uint32_t call_clobbers(Op* ops, Op* call) {
+    Convention* callee = find_convention(call->routine_call.name);
+    if (callee == NULL || !callee->internal) return SYSTEM_V_CLOBBERS;
+
+    uint32_t clobbers = plan_convention(ops, callee);
+    for (size_t i = 0; i < arrlenu(call->routine_call.args); ++i) clobbers |= REGISTER_BIT(callee->params[i]);
+    return clobbers;
+}
+
+// Callees are planned before their callers, a call back into a routine that
+// is still being planned may change anything
+static uint32_t plan_convention(Op* ops, Convention* convention) {
+    if (convention->state == Planned) return convention->clobbers;
+    if (convention->state == Planning) return SYSTEM_V_CLOBBERS;
+    convention->state = Planning;
+
+    size_t routine = convention->routine;
+    size_t end = routine_end(ops, routine);
+    Arg* params = ops[routine].new_routine.args;
+
+    // The System V argument registers hold the parameters up to the prolog
+    uint32_t clobbered = 0;
+    for (size_t i = 0; i < arrlenu(params); ++i) clobbered |= REGISTER_BIT(x86_64_linux_call_registers[i]);
+    for (size_t i = routine + 1; i < end; ++i) {
+        if (ops[i].type == RoutineCall || ops[i].type == TailCall) clobbered |= call_clobbers(ops, &ops[i]);
+    }
+
+    count_slot_reads(ops, routine);
+    convention->homes = assign_home_registers(ops, routine, clobbered);
+
+    uint32_t clobbers = SCRATCH_REGISTERS | clobbered;
+    for (size_t i = 0; i < hmlenu(convention->homes); ++i) {
+        if (!is_callee_saved(convention->homes[i].value)) clobbers |= REGISTER_BIT(convention->homes[i].value);
+    }
+
+    for (size_t i = 0; i < arrlenu(params); ++i) {
+        long home = hmgeti(convention->homes, params[i].position);
+        bool in_home = convention->internal && home != -1 && !is_callee_saved(convention->homes[home].value);
+        convention->params[i] = in_home ? convention->homes[home].value : x86_64_linux_call_registers[i];
+    }
+
+    convention->clobbers = clobbers;
+    convention->state = Planned;
+    return clobbers;
+}
+
+static void plan_conventions(Op* ops, bool optimize) {
+    for (size_t i = 0; i < arrlenu(ops); ++i) {
+        if (ops[i].type != NewRoutine) continue;
+
+        char* name = ops[i].new_routine.name;
+        Convention convention = {
+            .routine = i,
+            .internal = optimize && !ops[i].new_routine.exported && strcmp(name, "main") != 0
+        };
+        memcpy(convention.params, x86_64_linux_call_registers, sizeof(convention.params));
+
+        arrpush(conventions, convention);
+        shput(convention_index, name, arrlenu(conventions) - 1);
+    }
+
+    if (!optimize) return;
+    for (size_t i = 0; i < arrlenu(conventions); ++i) plan_convention(ops, &conventions[i]);
+}
+
+static void free_conventions() {
+    for (size_t i = 0; i < arrlenu(conventions); ++i) hmfree(conventions[i].homes);
+    arrfree(conventions);
+    shfree(convention_index);
+    homes = NULL;
+}
+
+// cmp and a single jcc instead of setcc, a byte in memory, test and jz. The
+// byte is still stored when something else reads it
+static void compare_and_jump(Instr** out, Op cmp, Op next) {
+    Arg dst = cmp.binop.offset_dst;
+    BinaryOp condition = cmp.binop.op;
+    size_t label = 0;
+
+    switch (next.type) {
+        case JumpIfNot: {
+            label = next.jump_if_not.label;
+            condition = negate_comparison(condition);
+        } break;
+        case JumpIf: label = next.jump_if.label; break;
+        default: UNREACHABLE("Not a conditional jump");
+    }
+
+    binary_operation_compare(out, cmp);
+    if (hmget(slot_reads, dst.position) > 0) binary_operation_load_cmp_dst(out, dst, comparison_set(cmp.binop.op));
+    emit(out, NewInstr(comparison_jump(condition), OperandLabel(label)));
+}
+
+// Both values are loaded up front, rcx and rdx are free between calls
+static void select_values(Instr** out, Op op) {
+    Size size = op.select.offset_dst.size;
+    mov(out, OperandReg(Rcx, size), op.select.if_false);
+    mov(out, OperandReg(Rdx, size), op.select.if_true);
+}
+
+// cmov has no byte form, only the low byte gets stored anyway
+static void select_store(Instr** out, Arg dst, Mnemonic cmov) {
+    Size size = dst.size == Byte ? DWord : dst.size;
+    emit(out, NewInstr(cmov, OperandReg(Rcx, size), OperandReg(Rdx, size)));
+    emit(out, NewInstr(InstrMov, OperandLocal(dst.position, dst.size), OperandReg(Rcx, dst.size)));
+}
+
+static void select_operation(Instr** out, Op op) {
+    Arg cond = op.select.cond;
+    select_values(out, op);
+    binary_operation_load_factor(out, cond, cond.size, InstrMov);
+    emit(out, NewInstr(InstrTest, OperandReg(Rbx, cond.size), OperandReg(Rbx, cond.size)));
+    select_store(out, op.select.offset_dst, InstrCmovnz);
+}
+
+static void compare_and_select(Instr** out, Op cmp, Op next) {
+    Arg dst = cmp.binop.offset_dst;
+    select_values(out, next);
+    binary_operation_compare(out, cmp);
+    if (hmget(slot_reads, dst.position) > 0) binary_operation_load_cmp_dst(out, dst, comparison_set(cmp.binop.op));
+    select_store(out, next.select.offset_dst, comparison_move(cmp.binop.op));
+}
+
+static Operand vector(size_t index) {
+    return OperandReg((use_avx2 ? Ymm0 : Xmm0) + index, QWord);
+}
+
+static Operand xmm(size_t index) {
+    return OperandReg(Xmm0 + index, QWord);
+}
+
+// dst = a op b. Without AVX the instruction overwrites its first operand,
+// so a is copied there first
+static void vector_op(Instr** out, Mnemonic mnemonic, Operand dst, Operand a, Operand b) {
+    if (use_avx2) {
+        emit(out, NewInstr(mnemonic, dst, a, b));
+        return;
+    }
+
+    if (dst.reg != a.reg) emit(out, NewInstr(InstrMovdqa, dst, a));
+    emit(out, NewInstr(mnemonic, dst, b));
+}
+
+// Every lane of the vector gets the low element of reg
+static void broadcast(Instr** out, Register reg, Size element, size_t index) {
+    Operand low = xmm(index);
+    if (element == QWord) emit(out, NewInstr(InstrMovq, low, OperandReg(reg, QWord)));
+    else emit(out, NewInstr(InstrMovd, low, OperandReg(reg, DWord)));
+
+    if (use_avx2) {
+        Mnemonic mnemonic = element == Byte ? InstrVpbroadcastb : element == DWord ? InstrVpbroadcastd : InstrVpbroadcastq;
+        emit(out, NewInstr(mnemonic, vector(index), low));
+        return;
+    }
+
+    switch (element) {
+        case Byte: {
+            vector_op(out, InstrPunpcklbw, low, low, low);
+            vector_op(out, InstrPunpcklwd, low, low, low);
+            emit(out, NewInstr(InstrPshufd, low, low, OperandImm(0, Byte)));
+        } break;
+        case DWord: emit(out, NewInstr(InstrPshufd, low, low, OperandImm(0, Byte))); break;
+        case QWord: vector_op(out, InstrPunpcklqdq, low, low, low); break;
+        default: UNREACHABLE("Invalid Arg size");
+    }
+}
+
+// dst = the smaller (Lt) or larger (Gt) of dst and other in every lane,
+// other and mask are clobbered. SSE2 has no signed 32-bit min or max, the
+// lanes of other that win are picked with a mask of the comparison instead
+static void vector_min_max(Instr** out, BinaryOp op, Size element, Operand dst, Operand other, Operand mask) {
+    if (element == Byte) {
+        vector_op(out, op == Lt ? InstrPminub : InstrPmaxub, dst, dst, other);
+        return;
+    }
+
+    if (use_avx2) {
+        vector_op(out, op == Lt ? InstrPminsd : InstrPmaxsd, dst, dst, other);
+        return;
+    }
+
+    if (op == Lt) vector_op(out, InstrPcmpgtd, mask, dst, other);
+    else vector_op(out, InstrPcmpgtd, mask, other, dst);
+    vector_op(out, InstrPand, other, other, mask);
+    vector_op(out, InstrPandn, mask, mask, dst);
+    vector_op(out, InstrPor, dst, mask, other);
+}
+
+// Folds the elements loaded in v1 into v0. Sums and counts are kept in
+// 64-bit lanes, which do not overflow before the result itself would
+static void reduce_vector(Instr** out, BinaryOp op, Size element, bool is_signed) {
+    Operand acc = vector(0);
+    Operand loaded = vector(1);
+    Operand needle = vector(2);
+    Operand temp = vector(3);
+    Operand zero = vector(4);
+
+    switch (op) {
+        case Add: {
+            if (element == Byte) vector_op(out, InstrPsadbw, loaded, loaded, zero);
+            else if (element == DWord) {
+                // Each 32-bit lane is paired with its sign, or with zeros
+                Operand high = zero;
+                if (is_signed) {
+                    vector_op(out, InstrPcmpgtd, needle, zero, loaded);
+                    high = needle;
+                }
+                vector_op(out, InstrPunpckldq, temp, loaded, high);
+                vector_op(out, InstrPunpckhdq, loaded, loaded, high);
+                vector_op(out, InstrPaddq, acc, acc, temp);
+            }
+            vector_op(out, InstrPaddq, acc, acc, loaded);
+        } break;
+        case Eq: {
+            // SSE2 compares 64-bit lanes as two halves that both have to match
+            if (element == QWord) {
+                vector_op(out, InstrPcmpeqd, loaded, loaded, needle);
+                emit(out, NewInstr(InstrPshufd, temp, loaded, OperandImm(0xB1, Byte)));
+                vector_op(out, InstrPand, loaded, loaded, temp);
+                vector_op(out, InstrPsubq, acc, acc, loaded);
+                break;
+            }
+
+            // A match is all ones, 0 - mask makes it a one that psadbw adds up
+            vector_op(out, element == Byte ? InstrPcmpeqb : InstrPcmpeqd, loaded, loaded, needle);
+            vector_op(out, element == Byte ? InstrPsubb : InstrPsubd, temp, zero, loaded);
+            vector_op(out, InstrPsadbw, temp, temp, zero);
+            vector_op(out, InstrPaddq, acc, acc, temp);
+        } break;
+        case Lt:
+        case Gt: vector_min_max(out, op, element, acc, loaded, temp); break;
+        default: UNREACHABLE("Not a reduction");
+    }
+}
+
+// Folds the lanes of v0 into rax, the upper half of a 256-bit vector first
+static void reduce_lanes(Instr** out, BinaryOp op, Size element) {
+    bool sums = op == Add || op == Eq;
+
+    if (use_avx2) {
+        emit(out, NewInstr(InstrVextracti128, xmm(1), vector(0), OperandImm(1, Byte)));
+        if (sums) vector_op(out, InstrPaddq, xmm(0), xmm(0), xmm(1));
+        else vector_min_max(out, op, element, xmm(0), xmm(1), xmm(3));
+    }
+
+    if (sums) {
+        vector_op(out, InstrPsrldq, xmm(1), xmm(0), OperandImm(8, Byte));
+        vector_op(out, InstrPaddq, xmm(0), xmm(0), xmm(1));
+        emit(out, NewInstr(InstrMovq, OperandReg(Rbx, QWord), xmm(0)));
+        emit(out, NewInstr(InstrAdd, OperandReg(Rax, QWord), OperandReg(Rbx, QWord)));
+    } else {
+        // The result started out in every lane, so what is left is the result
+        for (int64_t shift = 8; shift >= ((int64_t)1 << element); shift /= 2) {
+            vector_op(out, InstrPsrldq, xmm(1), xmm(0), OperandImm(shift, Byte));
+            vector_min_max(out, op, element, xmm(0), xmm(1), xmm(3));
+        }
+
+        emit(out, NewInstr(InstrMovd, OperandReg(Rbx, DWord), xmm(0)));
+        if (element == Byte) emit(out, NewInstr(InstrMovzx, OperandReg(Rax, QWord), OperandReg(Rbx, Byte)));
+        else emit(out, NewInstr(InstrMovsxd, OperandReg(Rax, QWord), OperandReg(Rbx, DWord)));
+    }
+
+    // Dirty upper halves slow down the SSE code of whatever runs next
+    if (use_avx2) emit(out, NewInstr(InstrVzeroupper));
+}
+
+// One element at [rsi] folded into rax
+static void reduce_element(Instr** out, BinaryOp op, Size element, bool is_signed) {
+    Arg loaded = { .size = element, .is_signed = is_signed };
+    Size reg_size = QWord;
+    Mnemonic load = right_mov(QWord, loaded, &reg_size);
+    Operand rax = OperandReg(Rax, QWord);
+    Operand rbx = OperandReg(Rbx, QWord);
+    emit(out, NewInstr(load, OperandReg(Rbx, reg_size), OperandMem(Rsi, 0, element)));
+
+    switch (op) {
+        case Add: emit(out, NewInstr(InstrAdd, rax, rbx)); break;
+        case Eq: {
+            emit(out, NewInstr(InstrCmp, OperandReg(Rbx, element), OperandReg(Rdx, element)));
+            emit(out, NewInstr(InstrSete, OperandReg(Rbx, Byte)));
+            emit(out, NewInstr(InstrMovzx, rbx, OperandReg(Rbx, Byte)));
+            emit(out, NewInstr(InstrAdd, rax, rbx));
+        } break;
+        case Lt:
+        case Gt: {
+            BinaryOp compare = is_signed ? op : op == Lt ? ULt : UGt;
+            emit(out, NewInstr(InstrCmp, rbx, rax));
+            emit(out, NewInstr(comparison_move(compare), rax, rbx));
+        } break;
+        default: UNREACHABLE("Not a reduction");
+    }
+}
+
+// The whole vectors of elements go first and the few left over after them
+// one at a time:
+//
+//     rdi = base + (count & -lanes) * size
+//     do { v0 = v0 op [rsi]; rsi += width } while (rsi < rdi)
+//     rax = rax op the lanes of v0
+//     rcx = count & (lanes - 1)
+//     while (rcx != 0) { rax = rax op [rsi]; rsi += size; rcx -= 1 }
+static void reduce_operation(Instr** out, Op op) {
+    BinaryOp reduction = op.reduce.op;
+    Size element = op.reduce.element;
+    Arg dst = op.reduce.offset_dst;
+    int64_t size = (int64_t)1 << element;
+    int64_t width = use_avx2 ? 32 : 16;
+    int64_t lanes = width / size;
+
+    size_t vector_loop = next_label++;
+    size_t tail = next_label++;
+    size_t scalar_loop = next_label++;
+    size_t done = next_label++;
+
+    Operand rcx = OperandReg(Rcx, QWord);
+    Operand rsi = OperandReg(Rsi, QWord);
+    Operand rdi = OperandReg(Rdi, QWord);
+
+    load_operand(out, Rsi, QWord, op.reduce.base);
+    load_operand(out, Rcx, QWord, op.reduce.count);
+    load_operand(out, Rax, QWord, op.reduce.acc);
+    if (reduction == Eq) load_operand(out, Rdx, QWord, op.reduce.needle);
+
+    emit(out, NewInstr(InstrMov, rdi, rcx));
+    emit(out, NewInstr(InstrAnd, rdi, OperandImm(-lanes, QWord)));
+    emit(out, NewInstr(InstrJz, OperandLabel(tail)));
+    if (element != Byte) emit(out, NewInstr(InstrSal, rdi, OperandImm(element, Byte)));
+    emit(out, NewInstr(InstrAdd, rdi, rsi));
+
+    vector_op(out, InstrPxor, vector(4), vector(4), vector(4));
+    if (reduction == Lt || reduction == Gt) broadcast(out, Rax, element, 0);
+    else vector_op(out, InstrPxor, vector(0), vector(0), vector(0));
+    if (reduction == Eq) broadcast(out, Rdx, element, 2);
+
+    emit(out, NewInstr(InstrLabel, OperandLabel(vector_loop)));
+    emit(out, NewInstr(InstrMovdqu, vector(1), OperandMem(Rsi, 0, QWord)));
+    reduce_vector(out, reduction, element, op.reduce.is_signed);
+    emit(out, NewInstr(InstrAdd, rsi, OperandImm(width, QWord)));
+    emit(out, NewInstr(InstrCmp, rsi, rdi));
+    emit(out, NewInstr(InstrJb, OperandLabel(vector_loop)));
+    reduce_lanes(out, reduction, element);
+
+    emit(out, NewInstr(InstrLabel, OperandLabel(tail)));
+    emit(out, NewInstr(InstrAnd, rcx, OperandImm(lanes - 1, QWord)));
+    emit(out, NewInstr(InstrJz, OperandLabel(done)));
+    emit(out, NewInstr(InstrLabel, OperandLabel(scalar_loop)));
+    reduce_element(out, reduction, element, op.reduce.is_signed);
+    emit(out, NewInstr(InstrAdd, rsi, OperandImm(size, QWord)));
+    emit(out, NewInstr(InstrSub, rcx, OperandImm(1, QWord)));
+    emit(out, NewInstr(InstrJnz, OperandLabel(scalar_loop)));
+
+    emit(out, NewInstr(InstrLabel, OperandLabel(done)));
+    emit(out, NewInstr(InstrMov, OperandLocal(dst.position, dst.size), OperandReg(Rax, dst.size)));
+}
+
+// Whether anything reads what the call right before start returned, which
+// stays in rax up to the next call
+static bool return_value_read(Op* ops, size_t start, size_t end) {
+    for (size_t i = start; i < end; ++i) {
+        Arg reads[MAX_OP_READS];
+        size_t count = op_reads(&ops[i], reads);
+        for (size_t j = 0; j < count; ++j) {
+            if (reads[j].type == ReturnVal) return true;
+        }
+
+        switch (ops[i].type) {
+            case Label:
+            case RoutineCall:
+            case TailCall:
+            case RtReturn:
+            case Jump:
+            case JumpIf:
+            case JumpIfNot: return false;
+            default: break;
+        }
+    }
+
+    return false;
+}
+
+#define FORMAT_BUFFER_SIZE 96
+#define MAX_FORMAT_TEXT 64
+
+// Text, a single %d, %i or %u conversion (or their long forms) and text
+// again up to a final newline
+typedef struct {
+    const char* prefix;
+    size_t prefix_length;
+    const char* suffix;
+    size_t suffix_length;
+    Arg value;
+} IntegerFormat;
+
+static bool integer_format(const char* format, size_t length, Arg arg, IntegerFormat* result) {
+    const char* percent = memchr(format, '%', length);
+    const char* end = format + length - 1;
+    if (percent == NULL || *end != '\n') return false;
+
+    const char* spec = percent + 1;
+    Size size = DWord;
+    if (spec < end && *spec == 'l') {
+        size = QWord;
+        spec += 1;
+    }
+    if (spec >= end || (*spec != 'd' && *spec != 'i' && *spec != 'u')) return false;
+
+    // The conversion reads the register at its own width
+    const char* suffix = spec + 1;
+    size_t suffix_length = end - suffix;
+    if (memchr(suffix, '%', suffix_length) != NULL || arg.size != size) return false;
+    if ((size_t)(percent - format) + suffix_length > MAX_FORMAT_TEXT) return false;
+
+    arg.is_signed = *spec != 'u';
+    *result = (IntegerFormat) { format, percent - format, suffix, suffix_length, arg };
+    return true;
+}
+
+static void store_text(Instr** out, Register base, int64_t disp, const char* text, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        emit(out, NewInstr(InstrMov, OperandMem(base, disp + (int64_t)i, Byte), OperandImm((unsigned char)text[i], Byte)));
+    }
+}
+
+// printf("text %d text\n", x) is formatted right here, in a buffer below
+// rsp, and the line handed to puts, which writes it through the same stdio
+// buffer and adds the newline. The digits come out last to first, dividing
+// by 10 with a multiplication by its inverse.
+static void format_integer(Instr** out, IntegerFormat format) {
+    int64_t text_end = FORMAT_BUFFER_SIZE - 1 - (int64_t)format.suffix_length;
+    size_t digit_loop = next_label++;
+    size_t positive = next_label++;
+    size_t signed_done = next_label++;
+
+    Operand rax = OperandReg(Rax, QWord);
+    Operand rbx = OperandReg(Rbx, QWord);
+    Operand rdx = OperandReg(Rdx, QWord);
+    Operand rsi = OperandReg(Rsi, QWord);
+    Operand rdi = OperandReg(Rdi, QWord);
+    Operand rsp = OperandReg(Rsp, QWord);
+    bool is_signed = format.value.is_signed;
+
+    load_operand(out, Rax, QWord, format.value);
+    emit(out, NewInstr(InstrSub, rsp, OperandImm(FORMAT_BUFFER_SIZE, QWord)));
+    store_text(out, Rsp, text_end, format.suffix, format.suffix_length);
+    emit(out, NewInstr(InstrMov, OperandMem(Rsp, FORMAT_BUFFER_SIZE - 1, Byte), OperandImm(0, Byte)));
+    emit(out, NewInstr(InstrLea, rsi, OperandMem(Rsp, text_end, QWord)));
+
+    // The most negative value stays what it is, and reads right unsigned
+    if (is_signed) {
+        emit(out, NewInstr(InstrMov, rdi, rax));
+        emit(out, NewInstr(InstrCmp, rax, OperandImm(0, QWord)));
+        emit(out, NewInstr(InstrJge, OperandLabel(positive)));
+        emit(out, NewInstr(InstrNeg, rax));
+        emit(out, NewInstr(InstrLabel, OperandLabel(positive)));
+    }
+
+    emit(out, NewInstr(InstrLabel, OperandLabel(digit_loop)));
+    emit(out, NewInstr(InstrMov, rbx, rax));
+    emit(out, NewInstr(InstrMov, rdx, OperandImm((int64_t)0xCCCCCCCCCCCCCCCDULL, QWord)));
+    emit(out, NewInstr(InstrMul, rdx));
+    emit(out, NewInstr(InstrShr, rdx, OperandImm(3, Byte)));
+    emit(out, NewInstr(InstrMov, rax, rdx));
+    emit(out, NewInstr(InstrImul, rdx, rdx, OperandImm(10, QWord)));
+    emit(out, NewInstr(InstrSub, rbx, rdx));
+    emit(out, NewInstr(InstrAdd, rbx, OperandImm('0', QWord)));
+    emit(out, NewInstr(InstrSub, rsi, OperandImm(1, QWord)));
+    emit(out, NewInstr(InstrMov, OperandMem(Rsi, 0, Byte), OperandReg(Rbx, Byte)));
+    emit(out, NewInstr(InstrTest, rax, rax));
+    emit(out, NewInstr(InstrJnz, OperandLabel(digit_loop)));
+
+    if (is_signed) {
+        emit(out, NewInstr(InstrCmp, rdi, OperandImm(0, QWord)));
+        emit(out, NewInstr(InstrJge, OperandLabel(signed_done)));
+        emit(out, NewInstr(InstrSub, rsi, OperandImm(1, QWord)));
+        emit(out, NewInstr(InstrMov, OperandMem(Rsi, 0, Byte), OperandImm('-', Byte)));
+        emit(out, NewInstr(InstrLabel, OperandLabel(signed_done)));
+    }
+
+    if (format.prefix_length > 0) {
+        store_text(out, Rsi, -(int64_t)format.prefix_length, format.prefix, format.prefix_length);
+        emit(out, NewInstr(InstrSub, rsi, OperandImm(format.prefix_length, QWord)));
+    }
+
+    emit(out, NewInstr(InstrMov, rdi, rsi));
+    emit(out, NewInstr(InstrCall, OperandSymbol("puts")));
+    emit(out, NewInstr(InstrAdd, rsp, OperandImm(FORMAT_BUFFER_SIZE, QWord)));
+}
+
+// The format has to be a literal, and what printf returns is not what puts
+// does, so nothing may read it
+static bool formatted_printf(Instr** out, Op* ops, size_t index, size_t end) {
+    Op op = ops[index];
+    Arg* args = op.routine_call.args;
+    if (strcmp(op.routine_call.name, "printf") != 0 || arrlenu(args) != 2) return false;
+    if (args[0].type != Offset || args[1].type == Offset || return_value_read(ops, index + 1, end)) return false;
+
+    const char* raw = static_strings[args[0].position].string;
+    char* format = malloc(strlen(raw) + 1);
+    long count = decode_string(raw, format);
+    size_t length = 0;
+    while ((long)length < count && format[length] != '\0') length += 1;
+
+    IntegerFormat integer = {0};
+    bool formatted = length > 0 && integer_format(format, length, args[1], &integer);
+    if (formatted) format_integer(out, integer);
+
+    free(format);
+    return formatted;
+}
+
+static void jump(Instr** out, Op op) {
+    emit(out, NewInstr(InstrJmp, OperandLabel(op.jump.label)));
+}
+
+static void label(Instr** out, Op op) {
+    emit(out, NewInstr(InstrLabel, OperandLabel(op.label.index)));
+}
+
+static void assign_local(Instr** out, Op op) {
     Arg src = op.assign_loc.arg;
     Arg dst = op.assign_loc.offset_dst;
 
     switch (dst.type) {
-        case Position: assign_local_value(out, dst, src); break;
+        case Position: mov(out, OperandLocal(dst.position, dst.size), src); break;
         default: UNREACHABLE("Destination Arg can only be of the offset type");
     }
 }
 
-static void routine_prolog(String_Builder* out, Op op) {
-    sb_appendf(out, ".globl %s\n", op.new_routine.name);
-    sb_appendf(out, "%s:\n", op.new_routine.name);
-    sb_appendf(out, "    push rbp\n");
-    sb_appendf(out, "    mov rbp, rsp\n");
+// The System V ABI leaves the 128 bytes below rsp alone, signal handlers
+// included, so only a call can write over them
+#define RED_ZONE_SIZE 128
+
+static bool is_param_or_value(Arg* params, Arg arg) {
+    if (arg.type == Value) return true;
+    if (arg.type != Position) return false;
+
+    for (size_t i = 0; i < arrlenu(params); ++i) {
+        if (params[i].position == arg.position) return true;
+    }
+    return false;
+}
+
+static size_t jumps_to(Op* ops, size_t routine, size_t end, size_t label) {
+    size_t count = 0;
+    for (size_t i = routine + 1; i < end; ++i) {
+        switch (ops[i].type) {
+            case Jump: count += ops[i].jump.label == label; break;
+            case JumpIfNot: count += ops[i].jump_if_not.label == label; break;
+            case JumpIf: count += ops[i].jump_if.label == label; break;
+            default: break;
+        }
+    }
+    return count;
+}
+
+// Checks at the start of a routine that only compare parameters and return
+// one of them or a constant, like the base case of a recursion, are taken
+// before the frame is set up. Nothing else may jump to the code after them,
+// it would run the prolog twice
+static size_t early_exits_end(Op* ops, size_t routine) {
+    Arg* params = ops[routine].new_routine.args;
+    size_t end = routine_end(ops, routine);
+    size_t i = routine + 1;
+
+    while (i + 4 < end) {
+        Op cmp = ops[i];
+        Op jump = ops[i + 1];
+        Op ret = ops[i + 2];
+        Op label = ops[i + 3];
+
+        if (!is_fused_compare(cmp, jump) || hmget(slot_reads, cmp.binop.offset_dst.position) > 0) break;
+        if (!is_param_or_value(params, cmp.binop.lhs) || !is_param_or_value(params, cmp.binop.rhs)) break;
+        if (ret.type != RtReturn || !is_param_or_value(params, ret.return_routine.ret)) break;
+
+        size_t target = jump.type == JumpIf ? jump.jump_if.label : jump.jump_if_not.label;
+        if (label.type != Label || label.label.index != target) break;
+        if (jumps_to(ops, routine, end, target) != 1) break;
+
+        i += 4;
+    }
+
+    return i;
+}
+
+static void plan_frame(Op* ops, size_t routine, bool optimize, Convention* convention) {
+    frame.params = ops[routine].new_routine.args;
+    frame.param_registers = convention->params;
+    frame.prolog_at = optimize ? early_exits_end(ops, routine) : routine + 1;
+    frame.entered = false;
+
+    size_t bytes = ops[routine].new_routine.bytes;
+    frame.saved_registers = (bytes + 7) & ~(size_t)7;
+    if (saved_registers_count() > 0) bytes = frame.saved_registers + saved_registers_count() * 8;
+
+    if (!optimize) {
+        frame.size = bytes > 0 ? round_to_next_pow2(bytes) : 0;
+        frame.red_zone = false;
+        return;
+    }
+
+    // A leaf small enough for the red zone needs no frame at all, everything
+    // else keeps rsp 16 byte aligned for the calls it makes
+    frame.size = (bytes + 15) & ~(size_t)15;
+    frame.red_zone = bytes <= RED_ZONE_SIZE && is_leaf(ops, routine);
+}
+
+static void routine_prolog(Instr** out, Op op) {
+    frame.entered = true;
+    if (!frame.red_zone) {
+        emit(out, NewInstr(InstrPush, OperandReg(Rbp, QWord)));
+        emit(out, NewInstr(InstrMov, OperandReg(Rbp, QWord), OperandReg(Rsp, QWord)));
+        if (frame.size > 0) emit(out, NewInstr(InstrSub, OperandReg(Rsp, QWord), OperandImm(frame.size, QWord)));
+    }
 
-    size_t bytes = op.new_routine.bytes;
-    if (bytes > 0) sb_appendf(out, "    sub rsp, %ld\n", round_to_next_pow2(bytes));
+    for (size_t i = 0; i < hmlenu(homes); ++i) {
+        Register reg = homes[i].value;
+        if (is_callee_saved(reg)) emit(out, NewInstr(InstrMov, saved_register(reg), OperandReg(reg, QWord)));
+    }
 
     for (size_t i = 0; i < arrlenu(op.new_routine.args); ++i) {
         Arg arg = op.new_routine.args[i];
-        sb_appendf(out, "    mov [rbp - %zu], %s\n", arg.position, x86_64_linux_call_registers[i][arg.size]);
+        Register reg = frame.param_registers[i];
+
+        // Passed right where the routine keeps it
+        long home = hmgeti(homes, arg.position);
+        if (home != -1 && homes[home].value == reg) continue;
+
+        emit(out, NewInstr(InstrMov, OperandLocal(arg.position, arg.size), OperandReg(reg, arg.size)));
     }
 }
 
-static void routine_epilog(String_Builder* out, Op op) {
+static void routine_epilog(Instr** out, Op op) {
     Arg return_value = op.return_routine.ret;
-    if (return_value.position == 0) sb_appendf(out, "    xor rax, rax\n");
+    if (return_value.type == ReturnVal) {
+        // Left in rax by the last call
+    } else if (return_value.position == 0) emit(out, NewInstr(InstrXor, OperandReg(Rax, QWord), OperandReg(Rax, QWord)));
     else {
-        const char* reg = x86_64_linux_rax_registers[return_value.size];
+        Operand reg = OperandReg(Rax, return_value.size);
         switch (return_value.type) {
             // TODO: just strings for now
-            case Offset: sb_appendf(out, "    movabs rax, offset .str_%zu\n", return_value.position); break;
-            case Position: sb_appendf(out, "    mov %s, [rbp - %zu]\n", reg, return_value.position); break;
-            case Value: {
-                sb_appendf(out, "    mov %s, ", reg); 
-                append_immediate(out, return_value);
-                sb_appendf(out, "\n");
-            } break;
+            case Offset: emit(out, NewInstr(InstrMovabs, OperandReg(Rax, QWord), OperandString(return_value.position))); break;
+            case Position: emit(out, NewInstr(InstrMov, reg, OperandLocal(return_value.position, return_value.size))); break;
+            case Value: emit(out, NewInstr(InstrMov, reg, immediate(return_value))); break;
             default: UNREACHABLE("Invalid Arg type");
         }
     }
 
-    sb_appendf(out, "    mov rsp, rbp\n");
-    sb_appendf(out, "    pop rbp\n");
-    sb_appendf(out, "    ret\n");
+    routine_teardown(out);
+    emit(out, NewInstr(InstrRet));
 }
 
-static void unary(String_Builder* out, Op op) {
+static void unary(Instr** out, Op op) {
     UnaryOp unop = op.unary.op;
     Arg arg = op.unary.arg;
     Arg dst = op.unary.offset_dst;
 
     assert(arg.type == Position);
 
+    Operand rbx = OperandReg(Rbx, QWord);
     switch (unop) {
-        case Deref: { 
-            sb_appendf(out, "    mov rbx, qword ptr [rbp - %zu]\n", arg.position);
-            sb_appendf(out, "    mov rbx, qword ptr [rbx]\n");
-            sb_appendf(out, "    mov [rbp - %zu], rbx\n", dst.position);
+        case Deref: {
+            emit(out, NewInstr(InstrMov, rbx, OperandLocal(arg.position, QWord)));
+            emit(out, NewInstr(InstrMov, rbx, OperandMem(Rbx, 0, QWord)));
+            emit(out, NewInstr(InstrMov, OperandLocal(dst.position, QWord), rbx));
         } break;
         case Ref: {
-            sb_appendf(out, "    lea rbx, [rbp - %zu]\n", arg.position);
-            sb_appendf(out, "    mov [rbp - %zu], rbx\n", dst.position);
+            emit(out, NewInstr(InstrLea, rbx, OperandLocal(arg.position, QWord)));
+            emit(out, NewInstr(InstrMov, OperandLocal(dst.position, QWord), rbx));
         }; break;
         case Not: TODO(""); break;
         default: UNREACHABLE("Invalid Unary Operation");
     }
 }
 
+static void append_ptr_dimension(String_Builder* out, Size size) {
+    switch (size) {
+        case Byte: sb_appendf(out, "byte"); break;
+        case Word: sb_appendf(out, "word"); break;
+        case DWord: sb_appendf(out, "dword"); break;
+        case QWord: sb_appendf(out, "qword"); break;
+        default: UNREACHABLE("Invalid Arg size");
+    }
+}
+
+static void append_operand(String_Builder* out, Mnemonic mnemonic, Operand operand) {
+    switch (operand.type) {
+        case RegisterOperand: sb_appendf(out, "%s", register_names[operand.reg][operand.size]); break;
+        case MemoryOperand: {
+            // lea only computes the address, so there is no access width, and
+            // a vector register says how much a vector instruction accesses
+            if (mnemonic != InstrLea && !is_vector_mnemonic(mnemonic)) {
+                append_ptr_dimension(out, operand.size);
+                sb_appendf(out, " ptr ");
+            }
+
+            const char* base = register_names[operand.mem.base][QWord];
+            if (operand.mem.disp < 0) sb_appendf(out, "[%s - %ld]", base, -operand.mem.disp);
+            else if (operand.mem.disp > 0) sb_appendf(out, "[%s + %ld]", base, operand.mem.disp);
+            else sb_appendf(out, "[%s]", base);
+        } break;
+        case ImmediateOperand: sb_appendf(out, "%ld", operand.imm); break;
+        case StringOperand: sb_appendf(out, "offset .str_%zu", operand.index); break;
+        case SymbolOperand: sb_appendf(out, "%s", operand.name); break;
+        case LabelOperand: sb_appendf(out, ".in_%zu", operand.label); break;
+        default: UNREACHABLE("Invalid Operand type");
+    }
+}
+
+static void append_instr(String_Builder* out, Instr instr) {
+    switch (instr.mnemonic) {
+        case InstrLabel: sb_appendf(out, ".in_%zu:\n", instr.operands[0].label); return;
+        case InstrRoutine: {
+            // What is on the internal convention cannot be called from outside
+            if (instr.operands[1].imm) sb_appendf(out, ".globl %s\n", instr.operands[0].name);
+            sb_appendf(out, "%s:\n", instr.operands[0].name);
+        } return;
+        default: break;
+    }
+
+    sb_appendf(out, "    %s%s", use_avx2 && has_vex_form(instr.mnemonic) ? "v" : "", mnemonic_names[instr.mnemonic]);
+    for (size_t i = 0; i < ARRAY_LEN(instr.operands) && instr.operands[i].type != NoOperand; ++i) {
+        sb_appendf(out, i == 0 ? " " : ", ");
+        append_operand(out, instr.mnemonic, instr.operands[i]);
+    }
+    sb_appendf(out, "\n");
+}
+
 static void generate_static_data(String_Builder* out, Arg arg, size_t index) {
     assert(arg.type == Offset);
     sb_appendf(out, ".str_%zu:\n", index);
@@ -491,35 +1846,113 @@ static void generate_static_data(String_Builder* out, Arg arg, size_t index) {
     sb_appendf(out, "    .size .str_%zu, %zu\n", index, strlen(arg.string) + 1);
 }
 
-static void static_data(String_Builder* out, Arg* data) {
+// Strings only used by routines the optimizer removed are not emitted
+static bool* referenced_strings(Instr* instrs, size_t count) {
+    bool* used = calloc(count == 0 ? 1 : count, sizeof(bool));
+
+    for (size_t i = 0; i < arrlenu(instrs); ++i) {
+        for (size_t j = 0; j < ARRAY_LEN(instrs[i].operands); ++j) {
+            if (instrs[i].operands[j].type == StringOperand) used[instrs[i].operands[j].index] = true;
+        }
+    }
+
+    return used;
+}
+
+static void static_data(String_Builder* out, Arg* data, bool* used) {
     for (size_t i = 0; i < arrlenu(data); ++i) {
+        if (used && !used[i]) continue;
         generate_static_data(out, data[i], i);
     }
 }
 
-bool generate_GAS_x86_64(String_Builder* out, Op* ops, Arg* data) {
-    sb_appendf(out, ".intel_syntax noprefix\n");
-    sb_appendf(out, ".text\n");
+bool generate_GAS_x86_64(String_Builder* out, Op* ops, Arg* data, CodegenOptions options) {
+    Instr* instrs = NULL;
+    size_t frameless = 0;
+    size_t early_exits = 0;
+    size_t formatted = 0;
+    size_t internal = 0;
+    size_t in_home = 0;
+    size_t routine = 0;
 
     size_t len = arrlenu(ops);
+    use_avx2 = options.avx2;
+    static_strings = data;
+    next_label = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (ops[i].type == Label && ops[i].label.index >= next_label) next_label = ops[i].label.index + 1;
+    }
+    plan_conventions(ops, options.optimize);
+
     for (size_t i = 0; i < len; ++i) {
         Op op = ops[i];
-        // sb_appendf(out, "# %s\n", display_op(op));
+        if (op.type == NewRoutine) routine = i;
+        else if (!frame.entered && i == frame.prolog_at) routine_prolog(&instrs, ops[routine]);
+
         switch (op.type) {
-            case RoutineCall: routine_call(out, op); break;
-            case NewRoutine: routine_prolog(out, op); break;
-            case RtReturn: routine_epilog(out, op); break;
-            case AssignLocal: assign_local(out, op); break;
-            case Binary: binary_operation(out, op); break;
-            case JumpIfNot: jump_if_not(out, op); break;
-            case Jump: jump(out, op); break;
-            case Label: label(out, op); break;
-            case Unary: unary(out, op); break;
+            case RoutineCall: {
+                if (options.optimize && formatted_printf(&instrs, ops, i, len)) formatted += 1;
+                else routine_call(&instrs, op);
+            } break;
+            case TailCall: tail_call(&instrs, op); break;
+            case NewRoutine: {
+                Convention* convention = find_convention(op.new_routine.name);
+                homes = convention->homes;
+                if (options.optimize) {
+                    count_slot_reads(ops, i);
+                    if (options.stats) nob_log(NOB_INFO, "registers: %s: %zu slots kept in registers", op.new_routine.name, hmlenu(homes));
+                }
+
+                plan_frame(ops, i, options.optimize, convention);
+                if (frame.red_zone) frameless += 1;
+                early_exits += (frame.prolog_at - i - 1) / 4;
+                internal += convention->internal;
+                for (size_t j = 0; j < arrlenu(op.new_routine.args); ++j) {
+                    in_home += convention->params[j] != x86_64_linux_call_registers[j];
+                }
+
+                emit(&instrs, NewInstr(InstrRoutine, OperandSymbol(op.new_routine.name), OperandImm(!convention->internal, Byte)));
+                if (frame.prolog_at == i + 1) routine_prolog(&instrs, op);
+            } break;
+            case RtReturn: routine_epilog(&instrs, op); break;
+            case AssignLocal: assign_local(&instrs, op); break;
+            case Binary: {
+                if (options.optimize && i + 1 < len && is_fused_compare(op, ops[i + 1])) {
+                    if (ops[i + 1].type == Select) compare_and_select(&instrs, op, ops[i + 1]);
+                    else compare_and_jump(&instrs, op, ops[i + 1]);
+                    ++i;
+                } else binary_operation(&instrs, op);
+            } break;
+            case JumpIfNot: jump_if_not(&instrs, op); break;
+            case JumpIf: jump_if(&instrs, op); break;
+            case Jump: jump(&instrs, op); break;
+            case Label: label(&instrs, op); break;
+            case Unary: unary(&instrs, op); break;
+            case Select: select_operation(&instrs, op); break;
+            case Reduce: reduce_operation(&instrs, op); break;
             default: UNREACHABLE("Unsupported Operation");
         }
-        // sb_appendf(out, "\n");
     }
 
-    static_data(out, data);
+    hmfree(slot_reads);
+    free_conventions();
+    if (options.stats) {
+        nob_log(NOB_INFO, "frames: %zu leaf routines without a frame", frameless);
+        nob_log(NOB_INFO, "shrinkwrap: %zu early exits taken before the frame is set up", early_exits);
+        nob_log(NOB_INFO, "libcalls: %zu printf calls formatted inline", formatted);
+        nob_log(NOB_INFO, "convention: %zu routines on the internal convention, %zu arguments passed in their home register", internal, in_home);
+    }
+    if (options.optimize) peephole_optimize(&instrs, options.stats);
+
+    sb_appendf(out, ".intel_syntax noprefix\n");
+    sb_appendf(out, ".text\n");
+
+    for (size_t i = 0; i < arrlenu(instrs); ++i) append_instr(out, instrs[i]);
+
+    bool* used = options.optimize ? referenced_strings(instrs, arrlenu(data)) : NULL;
+    static_data(out, data, used);
+
+    free(used);
+    arrfree(instrs);
     return true;
 }
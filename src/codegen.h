@@ -6,14 +6,175 @@
 #define NOB_STRIP_PREFIXES
 #include "nob.h"
 
+typedef enum {
+    Rax,
+    Rbx,
+    Rcx,
+    Rdx,
+    Rsi,
+    Rdi,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+    Rsp,
+    Rbp,
+    Xmm0,
+    Xmm1,
+    Xmm2,
+    Xmm3,
+    Xmm4,
+    Xmm5,
+    Ymm0,
+    Ymm1,
+    Ymm2,
+    Ymm3,
+    Ymm4,
+    Ymm5
+} Register;
+
 typedef struct {
+    enum {
+        NoOperand,
+        RegisterOperand,
+        MemoryOperand,
+        ImmediateOperand,
+        StringOperand,
+        SymbolOperand,
+        LabelOperand
+    } type;
     Size size;
-    enum { Register, Memory } type;
-    union { const char* reg; size_t position; } value;
-} Destination;
+    union {
+        Register reg;
+        struct { Register base; int64_t disp; } mem;
+        int64_t imm;
+        size_t index;
+        const char* name;
+        size_t label;
+    };
+} Operand;
+
+typedef enum {
+    InstrMov,
+    InstrMovsx,
+    InstrMovsxd,
+    InstrMovzx,
+    InstrMovabs,
+    InstrLea,
+    InstrAdd,
+    InstrSub,
+    InstrImul,
+    InstrMul,
+    InstrIdiv,
+    InstrDiv,
+    InstrCdq,
+    InstrCqo,
+    InstrNeg,
+    InstrSal,
+    InstrSar,
+    InstrShr,
+    InstrAnd,
+    InstrXor,
+    InstrCmp,
+    InstrTest,
+    InstrSete,
+    InstrSetne,
+    InstrSetl,
+    InstrSetle,
+    InstrSetg,
+    InstrSetge,
+    InstrSetb,
+    InstrSetbe,
+    InstrSeta,
+    InstrSetae,
+    InstrCmovz,
+    InstrCmovnz,
+    InstrCmovl,
+    InstrCmovle,
+    InstrCmovg,
+    InstrCmovge,
+    InstrCmovb,
+    InstrCmovbe,
+    InstrCmova,
+    InstrCmovae,
+    InstrJmp,
+    InstrJz,
+    InstrJnz,
+    InstrJl,
+    InstrJle,
+    InstrJg,
+    InstrJge,
+    InstrJb,
+    InstrJbe,
+    InstrJa,
+    InstrJae,
+    InstrCall,
+    InstrPush,
+    InstrPop,
+    InstrRet,
+    InstrMovd,
+    InstrMovq,
+    InstrMovdqu,
+    InstrMovdqa,
+    InstrPxor,
+    InstrPand,
+    InstrPandn,
+    InstrPor,
+    InstrPaddq,
+    InstrPsubb,
+    InstrPsubd,
+    InstrPsubq,
+    InstrPsadbw,
+    InstrPcmpeqb,
+    InstrPcmpeqd,
+    InstrPcmpgtd,
+    InstrPminub,
+    InstrPmaxub,
+    InstrPminsd,
+    InstrPmaxsd,
+    InstrPshufd,
+    InstrPsrldq,
+    InstrPunpcklbw,
+    InstrPunpcklwd,
+    InstrPunpckldq,
+    InstrPunpckhdq,
+    InstrPunpcklqdq,
+    InstrVpbroadcastb,
+    InstrVpbroadcastd,
+    InstrVpbroadcastq,
+    InstrVextracti128,
+    InstrVzeroupper,
+    InstrLabel,
+    InstrRoutine
+} Mnemonic;
+
+// One x86-64 instruction, or a label, kept around in memory so the peephole
+// optimizer can rewrite it before it is turned into text
+typedef struct {
+    Mnemonic mnemonic;
+    Operand operands[3];
+} Instr;
 
-#define NewDestination(size, reg) (Destination) { .size = size, .type = Register, .dst.reg = reg }
+#define OperandReg(r, s) (Operand) { .type = RegisterOperand, .size = s, .reg = r }
+#define OperandMem(b, d, s) (Operand) { .type = MemoryOperand, .size = s, .mem = { b, d } }
+#define OperandImm(v, s) (Operand) { .type = ImmediateOperand, .size = s, .imm = v }
+#define OperandString(i) (Operand) { .type = StringOperand, .size = QWord, .index = i }
+#define OperandSymbol(n) (Operand) { .type = SymbolOperand, .size = QWord, .name = n }
+#define OperandLabel(l) (Operand) { .type = LabelOperand, .size = QWord, .label = l }
+#define OperandLocal(position, s) OperandMem(Rbp, -(int64_t)(position), s)
+
+#define NewInstr(m, ...) (Instr) { .mnemonic = m, .operands = { __VA_ARGS__ } }
+
+typedef struct {
+    bool optimize;
+    bool stats;
+    bool avx2;
+} CodegenOptions;
 
-bool generate_GAS_x86_64(String_Builder* out, Op* ops, Arg* data);
+bool generate_GAS_x86_64(String_Builder* out, Op* ops, Arg* data, CodegenOptions options);
 
 #endif
@@ -10,6 +10,16 @@ static bool while_statement();
 static bool compile_expression(Arg* arg);
 static bool compile_expression_wrapped(Arg* arg, TokenType min_binding);
 
+// Multiplication, division and modulo bind equally tight, so a * b / c is
+// (a * b) / c and not a * (b / c)
+static TokenType binding_power(TokenType type) {
+    switch (type) {
+        case Slash:
+        case Percent: return Star;
+        default: return type;
+    }
+}
+
 static void free_arg(Arg arg) {
     if (arg.type == Offset && arg.is_signed) free(arg.string);
 }
@@ -38,9 +48,14 @@ const char* display_op(Op op) {
         case NewRoutine: return "Routine";
         case RtReturn: return "Return";
         case RoutineCall: return "RoutineCall";
+        case TailCall: return "TailCall";
         case Binary: return "Binary";
+        case Unary: return "Unary";
+        case Select: return "Select";
+        case Reduce: return "Reduce";
         case Label: return "Label";
         case JumpIfNot: return "JumpIfNot";
+        case JumpIf: return "JumpIf";
         case Jump: return "Jump";
         default: UNREACHABLE("");
     }
@@ -257,6 +272,7 @@ static bool routine_call(Arg* arg, char* name) {
     if (arg) {
         arg->type = ReturnVal;
         arg->size = QWord;
+        arg->is_signed = true;
     }
     return true;
 }
@@ -284,48 +300,116 @@ static bool identifier_expression(Arg* arg) {
     return true;
 }
 
+// The usual arithmetic conversions of C, without the promotion to int: the
+// wider operand wins, and between two as wide an unsigned one does
+static Arg operation_type(Arg lhs, Arg rhs) {
+    Size size = max(lhs.size, rhs.size);
+    bool is_signed = true;
+    if (!lhs.is_signed && lhs.size == size) is_signed = false;
+    if (!rhs.is_signed && rhs.size == size) is_signed = false;
+    return (Arg) { .type = Position, .size = size, .is_signed = is_signed };
+}
+
+static bool value_fits(int64_t value, Size size, bool is_signed) {
+    int bits = 8 << size;
+    if (bits == 64) return is_signed || value >= 0;
+    if (is_signed) return value >= -((int64_t)1 << (bits - 1)) && value < ((int64_t)1 << (bits - 1));
+    return value >= 0 && value < ((int64_t)1 << bits);
+}
+
+// A literal compared with an operand takes its type when its value fits in
+// it: i < 10 then compares two i32 and u < 10 two unsigned values, with the
+// same answer as the i64 comparison. Arithmetic keeps the i64 literal, an
+// i32 + 1 computed on 32 bits would wrap where the i64 sum does not
+static void adapt_literal(Arg* literal, Arg other) {
+    if (literal->type != Value || other.type == Value) return;
+    if (!value_fits(literal->buffer, other.size, other.is_signed)) return;
+
+    literal->size = other.size;
+    literal->is_signed = other.is_signed;
+}
+
+// An operand is read as the type of its operation. One as wide keeps its
+// bits and only changes signedness, a narrower one is extended into a slot
+// of that type first, the way an assignment to it would
+static void convert_operand(Arg* arg, Arg type) {
+    if (arg->size == type.size) {
+        arg->is_signed = type.is_signed;
+        return;
+    }
+
+    alloc_size(type.size);
+
+    Arg converted = {
+        .type = Position,
+        .size = type.size,
+        .position = comp.position,
+        .is_signed = type.is_signed
+    };
+
+    push_op(OpAssignLocal(converted, *arg));
+    *arg = converted;
+}
+
 static bool compile_binop(Arg* arg) {
     TokenType op_type = get_type();
     Arg rhs = {0};
 
     consume();
-    if (!compile_expression_wrapped(&rhs, op_type)) return false;
+    if (!compile_expression_wrapped(&rhs, binding_power(op_type))) return false;
 
+    bool comparison = op_type == EqualEqual || op_type == BangEqual || op_type == Less
+        || op_type == LessEqual || op_type == Greater || op_type == GreaterEqual;
+    if (comparison) {
+        adapt_literal(arg, rhs);
+        adapt_literal(&rhs, *arg);
+    }
+
+    Arg type = operation_type(*arg, rhs);
+    bool is_signed = type.is_signed;
     BinaryOp binop = 0;
-    Size size = max(arg->size, rhs.size);
+
     switch (op_type) {
         case Plus: binop = Add; break;
         case Minus: binop = Sub; break;
         case Star: binop = Mul; break;
-        case Slash: binop = Div; break;
+        case Slash: binop = is_signed ? Div : UDiv; break;
+        case Percent: binop = is_signed ? Mod : UMod; break;
         case ShiftRight: binop = RSh; break;
         case ShiftLeft: binop = LSh; break;
-        case EqualEqual: size = Byte; binop = Eq; break;
-        case Less: size = Byte; binop = Lt; break;
-        case LessEqual: size = Byte; binop = Le; break;
-        case Greater: size = Byte; binop = Gt; break;
-        case GreaterEqual: size = Byte; binop = Ge; break;
-        case BangEqual: size = Byte; binop = Ne; break;
+        case EqualEqual: binop = Eq; break;
+        case Less: binop = is_signed ? Lt : ULt; break;
+        case LessEqual: binop = is_signed ? Le : ULe; break;
+        case Greater: binop = is_signed ? Gt : UGt; break;
+        case GreaterEqual: binop = is_signed ? Ge : UGe; break;
+        case BangEqual: binop = Ne; break;
         default: UNREACHABLE("");
     }
 
-    alloc_size(size);
+    // An i8 divided by a u16 divides the u16 it converts to, not its own
+    // value extended to the width div works on
+    if (binop == Div || binop == Mod || binop == UDiv || binop == UMod) {
+        convert_operand(arg, type);
+        convert_operand(&rhs, type);
+    }
+
+    // A comparison gives a bool
+    if (binop >= Lt && binop <= Ne) {
+        type.size = Byte;
+        type.is_signed = false;
+    }
+
+    alloc_size(type.size);
     
     Arg dst = {
         .type = Position,
-        .size = size,
+        .size = type.size,
         .position = comp.position,
-        .is_signed = false // TODO: do not hardcode this
+        .is_signed = type.is_signed
     };
 
     push_op(OpBinary(dst, binop, *arg, rhs));
-
-    *arg = (Arg) {
-        .type = Position,
-        .size = size,
-        .position = comp.position,
-        .is_signed = false // TODO: do not hardcode this
-    };
+    *arg = dst;
 
     return true;
 }
@@ -366,6 +450,7 @@ static bool dereferencing(Arg* arg) {
 
     Arg ptr = {0};
     if (!compile_expression(&ptr)) return false;
+    alloc_size(QWord);
 
     *arg = (Arg) {  
         .size = QWord, // TODO: do not hardcode this
@@ -383,6 +468,7 @@ static bool referencing(Arg* arg) {
 
     Arg ptr = {0};
     if (!compile_expression(&ptr)) return false;
+    alloc_size(QWord);
 
     *arg = (Arg) {  
         .size = QWord,
@@ -414,11 +500,13 @@ static bool compile_primary_expression(Arg* arg) {
 static bool compile_expression_wrapped(Arg* arg, TokenType min_binding) {
     if (!compile_primary_expression(arg)) return false;
 
-    while (get_type() > min_binding) {
+    while (binding_power(get_type()) > min_binding) {
         switch (get_type()) {
             case Plus: 
             case Minus: 
             case Star:
+            case Slash:
+            case Percent:
             case GreaterEqual:
             case Greater:
             case EqualEqual:
@@ -427,7 +515,6 @@ static bool compile_expression_wrapped(Arg* arg, TokenType min_binding) {
             case ShiftLeft:
             case ShiftRight:
             case Less: if (!compile_binop(arg)) return false; break;
-            case Slash: TODO("Unsupported div op"); break;
             default: goto end_expr;
         }
     }
@@ -530,7 +617,11 @@ static bool return_statement() {
 
     Arg arg = {0};
     compile_expression(&arg);
-    push_op(OpReturn(arg));
+
+    // Returning what a call just returned lets the callee reuse the frame
+    Op* last = &arrlast(comp.ops);
+    if (arg.type == ReturnVal && last->type == RoutineCall) last->type = TailCall;
+    else push_op(OpReturn(arg));
 
     comp.returned = true;
     return true;
@@ -550,11 +641,14 @@ static bool if_statement() {
     if (get_type() == Else) {
         consume();
         size_t end_else_block = push_op(OpJump(0));
-        comp.ops[end_if_block].jump_if_not.label = push_label_op();
+        size_t else_label = push_label_op();
+        comp.ops[end_if_block].jump_if_not.label = else_label;
         if (!statement()) return false;
-        comp.ops[end_else_block].jump.label = push_label_op();
+        size_t end_label = push_label_op();
+        comp.ops[end_else_block].jump.label = end_label;
     } else {
-        comp.ops[end_if_block].jump_if_not.label = push_label_op();
+        size_t end_label = push_label_op();
+        comp.ops[end_if_block].jump_if_not.label = end_label;
     }
 
     return true;
@@ -613,14 +707,22 @@ static bool while_statement() {
     consume();
     if (!expect_and_consume(LeftParen)) return false;
 
-    size_t start_loop = push_label_op();
+    size_t cond_start = arrlenu(comp.ops);
     if (!compile_expression(&cond)) return false;
     if (!expect_and_consume(RightParen)) return false;
-    size_t jmpifnot = push_op(OpJumpIfNot(0, cond));
+    size_t cond_end = arrlenu(comp.ops);
+
+    size_t guard = push_op(OpJumpIfNot(0, cond));
+    size_t start_loop = push_label_op();
     if (!block_statement()) return false;
 
-    push_op(OpJump(start_loop));
-    comp.ops[jmpifnot].jump_if_not.label = push_label_op();
+    // The loop is rotated: the condition is tested once before entering it
+    // and then again at the bottom, so each iteration takes a single branch
+    for (size_t i = cond_start; i < cond_end; ++i) push_op(copy_op(comp.ops[i]));
+    push_op(OpJumpIf(start_loop, cond));
+
+    size_t end_loop = push_label_op();
+    comp.ops[guard].jump_if_not.label = end_loop;
 
     return true;
 }
@@ -664,13 +766,53 @@ static bool compile_routine_body() {
     return true;
 }
 
+// The frame is gone by the time a tail callee runs, so routines that take
+// the address of their locals return through the epilog as usual
+static void demote_tail_calls(size_t routine) {
+    bool takes_address = false;
+    for (size_t i = routine; i < arrlenu(comp.ops); ++i) {
+        takes_address |= comp.ops[i].type == Unary && comp.ops[i].unary.op == Ref;
+    }
+
+    if (!takes_address) return;
+
+    Op* ops = NULL;
+    for (size_t i = routine; i < arrlenu(comp.ops); ++i) {
+        arrpush(ops, comp.ops[i]);
+        if (comp.ops[i].type != TailCall) continue;
+        arrlast(ops).type = RoutineCall;
+        arrpush(ops, OpReturn(((Arg) { .type = ReturnVal, .size = QWord })));
+    }
+
+    arrsetlen(comp.ops, routine);
+    for (size_t i = 0; i < arrlenu(ops); ++i) arrpush(comp.ops, ops[i]);
+    arrfree(ops);
+}
+
+static InlineHint routine_inline_hint() {
+    switch (get_type()) {
+        case Inline: consume(); return InlineAlways;
+        case NoInline: consume(); return InlineNever;
+        default: return InlineAuto;
+    }
+}
+
+// Exported routines are kept even when nothing in the file calls them
+static bool routine_exported() {
+    if (get_type() != Export) return false;
+    consume();
+    return true;
+}
+
 static bool compile_routine() {
-    consume(); // Consume Routine
+    bool exported = routine_exported();
+    InlineHint hint = routine_inline_hint();
+    if (!expect_and_consume(Routine)) return false;
 
     char* routine_name = expect_consume_id_and_get_string();
     if (routine_name == NULL) return false;
 
-    size_t rt = push_op(OpNewRoutine(routine_name, 0, NULL));
+    size_t rt = push_op(OpNewRoutine(routine_name, 0, NULL, hint, exported));
 
     size_t prev_pos = comp.position;
     comp.position = 0;
@@ -687,6 +829,7 @@ static bool compile_routine() {
 
     comp.ops[rt].new_routine.bytes = comp.position;
     comp.ops[rt].new_routine.args = args;
+    demote_tail_calls(rt);
 
     comp.position = prev_pos;
 
@@ -703,9 +846,10 @@ void init_compiler() {
     comp.returned = false;
 }
 
-static void free_op(Op op) {
+void free_op(Op op) {
     switch (op.type) {
         case RoutineCall: 
+        case TailCall:
             for (size_t i = 0; i < arrlenu(op.routine_call.args); ++i) free_arg(op.routine_call.args[i]);
             arrfree(op.routine_call.args);
             free(op.routine_call.name);
@@ -736,16 +880,60 @@ static void free_op(Op op) {
             free_arg(op.unary.arg);
             break;
 
+        case Select:
+            free_arg(op.select.cond);
+            free_arg(op.select.if_true);
+            free_arg(op.select.if_false);
+            free_arg(op.select.offset_dst);
+            break;
+
+        case Reduce:
+            free_arg(op.reduce.acc);
+            free_arg(op.reduce.base);
+            free_arg(op.reduce.count);
+            free_arg(op.reduce.needle);
+            free_arg(op.reduce.offset_dst);
+            break;
+
         case JumpIfNot: 
             free_arg(op.jump_if_not.arg);
             break;
 
+        case JumpIf:
+            free_arg(op.jump_if.arg);
+            break;
+
         case Jump: break;
         case Label: break;
         default: UNREACHABLE("Unsupported Operation");
     }
 }
 
+static Arg* copy_args(Arg* args) {
+    Arg* result = NULL;
+    for (size_t i = 0; i < arrlenu(args); ++i) arrpush(result, args[i]);
+    return result;
+}
+
+Op copy_op(Op op) {
+    switch (op.type) {
+        case RoutineCall: 
+        case TailCall:
+            op.routine_call.name = strdup(op.routine_call.name);
+            op.routine_call.args = copy_args(op.routine_call.args);
+            break;
+
+        case NewRoutine: 
+            op.new_routine.name = strdup(op.new_routine.name);
+            op.new_routine.args = copy_args(op.new_routine.args);
+            break;
+
+        default: break;
+    }
+
+    return op;
+}
+
 void free_compiler() {
     for (size_t i = 0; i < arrlenu(comp.ops); ++i) free_op(comp.ops[i]);
     for (size_t i = 0; i < arrlenu(comp.local_vars); ++i) shfree(comp.local_vars[i]);
@@ -755,14 +943,67 @@ void free_compiler() {
     arrfree(comp.static_data);
 }
 
-Op* get_ops() {
-    return comp.ops;
+Op** get_ops() {
+    return &comp.ops;
 }
 
 Arg* get_data() {
     return comp.static_data;
 }
 
+// Adds a string literal made up after parsing, returning its index
+size_t push_string(char* string) {
+    Arg data = { .size = QWord, .type = Offset, .is_signed = true, .string = string };
+    arrpush(comp.static_data, data);
+    return arrlenu(comp.static_data) - 1;
+}
+
+static unsigned hex_digit(char c) {
+    return isdigit(c) ? (unsigned)(c - '0') : (unsigned)(tolower(c) - 'a' + 10);
+}
+
+// String literals are kept as written and the assembler reads their escapes
+// when it meets them in .asciz. This reads them the same way, returning how
+// many bytes the literal holds or -1 for an escape it does not know.
+long decode_string(const char* raw, char* bytes) {
+    size_t count = 0;
+
+    for (const char* c = raw; *c != '\0'; ++c) {
+        if (*c != '\\') {
+            bytes[count++] = *c;
+            continue;
+        }
+
+        c += 1;
+        unsigned value = 0;
+        size_t digits = 0;
+        switch (*c) {
+            case 'b': bytes[count++] = '\b'; break;
+            case 'f': bytes[count++] = '\f'; break;
+            case 'n': bytes[count++] = '\n'; break;
+            case 'r': bytes[count++] = '\r'; break;
+            case 't': bytes[count++] = '\t'; break;
+            case '\\': bytes[count++] = '\\'; break;
+            case '"': bytes[count++] = '"'; break;
+            case 'x': {
+                // Every hex digit that follows is part of it
+                while (isxdigit(c[digits + 1])) value = value * 16 + hex_digit(c[++digits]);
+                if (digits == 0) return -1;
+                bytes[count++] = (char)value;
+                c += digits;
+            } break;
+            default: {
+                while (digits < 3 && c[digits] >= '0' && c[digits] <= '7') value = value * 8 + (unsigned)(c[digits++] - '0');
+                if (digits == 0) return -1;
+                bytes[count++] = (char)value;
+                c += digits - 1;
+            } break;
+        }
+    }
+
+    return count;
+}
+
 bool generate_ops() {
     consume();
 
@@ -771,6 +1012,9 @@ bool generate_ops() {
         switch (current_token.type) {
             case Eof: return true;
             case ParseError: return false;
+            case Export:
+            case Inline:
+            case NoInline:
             case Routine: if (!compile_routine()) return false; break;
             default: {
                 error_msg("COMPILATION ERROR: A program file is composed by only routines");
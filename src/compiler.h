@@ -36,10 +36,17 @@ typedef enum {
     Sub,
     Mul,
     Div,
+    Mod,
+    UDiv,
+    UMod,
     Lt,
     Gt,
     Le,
     Ge,
+    ULt,
+    UGt,
+    ULe,
+    UGe,
     Eq,
     Ne,
     RSh,
@@ -52,27 +59,40 @@ typedef enum {
     Ref
 } UnaryOp;
 
+typedef enum {
+    InlineAuto,
+    InlineAlways,
+    InlineNever
+} InlineHint;
+
 typedef struct {
     enum {
         NewRoutine,
         RtReturn,
         AssignLocal,
         RoutineCall,
+        TailCall,
         Binary,
         Unary,
+        Select,
+        Reduce,
         Label,
         JumpIfNot,
+        JumpIf,
         Jump
     } type;
 
     union {
-        struct { char* name; size_t bytes; Arg* args; } new_routine;
+        struct { char* name; size_t bytes; Arg* args; InlineHint inline_hint; bool exported; } new_routine;
         struct { Arg ret; } return_routine;
         struct { Arg offset_dst; Arg arg; } assign_loc;
         struct { char* name; Arg* args; } routine_call;
         struct { Arg offset_dst; BinaryOp op; Arg lhs; Arg rhs; } binop;
         struct { Arg offset_dst; UnaryOp op; Arg arg; } unary;
+        struct { Arg offset_dst; Arg cond; Arg if_true; Arg if_false; } select;
+        struct { Arg offset_dst; BinaryOp op; Arg acc; Arg base; Arg count; Arg needle; Size element; bool is_signed; } reduce;
         struct { size_t label; Arg arg; } jump_if_not;
+        struct { size_t label; Arg arg; } jump_if;
         struct { size_t label; } jump;
         struct { size_t index; } label;
     };
@@ -80,12 +100,16 @@ typedef struct {
 
 #define OpAssignLocal(dst, src) (Op) {.type = AssignLocal, .assign_loc = { dst, src }}
 #define OpRoutineCall(name, args) (Op) {.type = RoutineCall, .routine_call = { name, args }}
+#define OpTailCall(name, args) (Op) {.type = TailCall, .routine_call = { name, args }}
 #define OpBinary(dst, op, lhs, rhs) (Op) {.type = Binary, .binop = { dst, op, lhs, rhs }}
 #define OpUnary(dst, op, arg) (Op) {.type = Unary, .unary = { dst, op, arg }}
+#define OpSelect(dst, cond, if_true, if_false) (Op) {.type = Select, .select = { dst, cond, if_true, if_false }}
+#define OpReduce(dst, op, acc, base, count, needle, element, is_signed) (Op) {.type = Reduce, .reduce = { dst, op, acc, base, count, needle, element, is_signed }}
 #define OpJumpIfNot(label, arg) (Op) {.type = JumpIfNot, .jump_if_not = { label, arg }}
+#define OpJumpIf(label, arg) (Op) {.type = JumpIf, .jump_if = { label, arg }}
 #define OpJump(label) (Op) {.type = Jump, .jump = { label }}
 #define OpLabel(index) (Op) {.type = Label, .label = { index }}
-#define OpNewRoutine(name, bytes, args) (Op) { .type = NewRoutine, .new_routine = { name, bytes, args }}
+#define OpNewRoutine(name, bytes, args, hint, exported) (Op) { .type = NewRoutine, .new_routine = { name, bytes, args, hint, exported }}
 #define OpReturn(arg) (Op) { .type = RtReturn, .return_routine.ret = arg }
 
 #define X86_64_LINUX_CALL_REGISTERS_NUM 6
@@ -112,8 +136,12 @@ typedef struct {
 void init_compiler();
 void free_compiler();
 bool generate_ops();
-Op* get_ops();
+Op** get_ops();
 Arg* get_data();
+size_t push_string(char* string);
+long decode_string(const char* raw, char* bytes);
 const char* display_op(Op op);
+void free_op(Op op);
+Op copy_op(Op op);
 
 #endif
@@ -50,6 +50,12 @@ static void keyword_id() {
 
     if (strcmp(id, "rt") == 0) {
         lexer.token_type = Routine;
+    } else if (strcmp(id, "inline") == 0) {
+        lexer.token_type = Inline;
+    } else if (strcmp(id, "noinline") == 0) {
+        lexer.token_type = NoInline;
+    } else if (strcmp(id, "export") == 0) {
+        lexer.token_type = Export;
     } else if (strcmp(id, "ret") == 0) {
         lexer.token_type = Return;
     } else if (strcmp(id, "if") == 0) {
@@ -176,6 +182,7 @@ bool next_token() {
         case '}': lexer.token_type = RightBracket; break;
         case ';': lexer.token_type = SemiColon; break;
         case '/': lexer.token_type = Slash; break;
+        case '%': lexer.token_type = Percent; break;
         case '+': lexer.token_type = Plus; break;
         case '-': lexer.token_type = Minus; break;
         case ',': lexer.token_type = Comma; break;
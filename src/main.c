@@ -2,6 +2,7 @@
 #include "lexer.h"
 #include "compiler.h"
 #include "codegen.h"
+#include "optimizer.h"
 
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
@@ -32,6 +33,11 @@ int main(int argc, char** argv) {
     char **output_file = flag_str("o", "a.out", "output file");
     bool *help = flag_bool("help", false, "Print this help to stdout and exit with 0");
     char **library = flag_str("l", NULL, "library to link to");
+    size_t *opt_level = flag_size("O", 1, "optimization level, 0 disables the optimizer");
+    size_t *inline_threshold = flag_size("inline", 16, "max size of a routine inlined without the inline attribute");
+    size_t *unroll = flag_size("unroll", 4, "loop unrolling factor, 1 disables partial unrolling");
+    bool *stats = flag_bool("stats", false, "Print how much each optimization pass changed");
+    bool *avx2 = flag_bool("avx2", false, "Vectorize loops with 256-bit AVX2 instead of SSE2");
 
     if (!flag_parse(argc, argv)) {
         print_usage(stderr, exe);
@@ -62,10 +68,15 @@ int main(int argc, char** argv) {
         exit(COMPILATION_ERROR);
     }
 
-    Op* ops = get_ops();
+    Op** ops = get_ops();
+    optimize_ops(ops, (OptimizerOptions) { .level = *opt_level, .unroll = *unroll, .inline_threshold = *inline_threshold, .stats = *stats });
+
+    // Fetched after the optimizer, which may add strings of its own
     Arg* data = get_data();
+
     String_Builder result = {0};
-    if (!generate_GAS_x86_64(&result, ops, data)) {
+    CodegenOptions codegen_options = { .optimize = *opt_level > 0, .stats = *stats, .avx2 = *avx2 };
+    if (!generate_GAS_x86_64(&result, *ops, data, codegen_options)) {
         free_lexer();
         free_compiler();
         exit(GEN_ERROR);
@@ -0,0 +1,3533 @@
+#include "optimizer.h"
+#include "compiler.h"
+#include <stdint.h>
+
+#define MAX_OP_ARGS (X86_64_LINUX_CALL_REGISTERS_NUM + 1)
+
+typedef struct {
+    size_t key;
+    size_t value;
+} IndexHashmap;
+
+typedef struct {
+    size_t start;
+    size_t end;
+    size_t* succs;
+    size_t* preds;
+} Block;
+
+typedef struct {
+    Op* ops;
+
+    // Everything below is derived from ops by analyze_routine and has to be
+    // recomputed every time a pass changes the shape of the routine
+    Block* blocks;
+    IndexHashmap* labels;
+    IndexHashmap* slots;
+    bool* escaped;
+    size_t words;
+    uint64_t** live_in;
+    uint64_t** live_out;
+    bool* reachable;
+    uint64_t** dominators;
+    size_t block_words;
+} RoutineBody;
+
+typedef struct {
+    size_t header;
+    uint64_t* body;
+    size_t* blocks;
+} Loop;
+
+typedef size_t (*Pass)(RoutineBody* rt);
+
+static OptimizerOptions options = {0};
+static size_t next_label = 0;
+
+// Loops the unroller already dealt with, keyed by their header label, so the
+// remainder loop it leaves behind is not unrolled all over again
+static struct { size_t key; bool value; }* unrolled_loops = NULL;
+
+static uint64_t* bitset_new(size_t words) {
+    return calloc(words == 0 ? 1 : words, sizeof(uint64_t));
+}
+
+static void bitset_set(uint64_t* set, size_t bit) {
+    set[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static void bitset_clear(uint64_t* set, size_t bit) {
+    set[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+static bool bitset_test(uint64_t* set, size_t bit) {
+    return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+static bool bitset_union(uint64_t* dst, uint64_t* src, size_t words) {
+    bool changed = false;
+    for (size_t i = 0; i < words; ++i) {
+        uint64_t value = dst[i] | src[i];
+        changed |= value != dst[i];
+        dst[i] = value;
+    }
+    return changed;
+}
+
+static const char* routine_name(RoutineBody* rt) {
+    return rt->ops[0].new_routine.name;
+}
+
+static Arg* op_dst(Op* op) {
+    switch (op->type) {
+        case AssignLocal: return &op->assign_loc.offset_dst;
+        case Binary: return &op->binop.offset_dst;
+        case Unary: return &op->unary.offset_dst;
+        case Select: return &op->select.offset_dst;
+        case Reduce: return &op->reduce.offset_dst;
+        default: return NULL;
+    }
+}
+
+static size_t op_args(Op* op, Arg* args[MAX_OP_ARGS]) {
+    size_t count = 0;
+
+    switch (op->type) {
+        case AssignLocal: args[count++] = &op->assign_loc.arg; break;
+        case Binary: {
+            args[count++] = &op->binop.lhs;
+            args[count++] = &op->binop.rhs;
+        } break;
+        case Unary: args[count++] = &op->unary.arg; break;
+        case Select: {
+            args[count++] = &op->select.cond;
+            args[count++] = &op->select.if_true;
+            args[count++] = &op->select.if_false;
+        } break;
+        case Reduce: {
+            args[count++] = &op->reduce.acc;
+            args[count++] = &op->reduce.base;
+            args[count++] = &op->reduce.count;
+            args[count++] = &op->reduce.needle;
+        } break;
+        case RtReturn: args[count++] = &op->return_routine.ret; break;
+        case JumpIfNot: args[count++] = &op->jump_if_not.arg; break;
+        case JumpIf: args[count++] = &op->jump_if.arg; break;
+        case RoutineCall:
+        case TailCall: {
+            for (size_t i = 0; i < arrlenu(op->routine_call.args); ++i) {
+                args[count++] = &op->routine_call.args[i];
+            }
+        } break;
+        case NewRoutine:
+        case Label:
+        case Jump: break;
+        default: UNREACHABLE("Unsupported Operation");
+    }
+
+    return count;
+}
+
+static int64_t truncate_value(int64_t value, Size size, bool is_signed) {
+    switch (size) {
+        case Byte: return is_signed ? (int64_t)(int8_t)value : (int64_t)(uint8_t)value;
+        case Word: return is_signed ? (int64_t)(int16_t)value : (int64_t)(uint16_t)value;
+        case DWord: return is_signed ? (int64_t)(int32_t)value : (int64_t)(uint32_t)value;
+        case QWord: return value;
+        default: UNREACHABLE("Invalid Arg size");
+    }
+}
+
+static bool is_division(BinaryOp op) {
+    return op == Div || op == Mod || op == UDiv || op == UMod;
+}
+
+// Dividing by anything but a known non zero value can fault, and so can a
+// signed division by -1 of the lowest value of the type
+static bool op_may_trap(Op* op) {
+    if (op->type == Binary && is_division(op->binop.op)) {
+        Arg rhs = op->binop.rhs;
+        if (rhs.type != Value) return true;
+
+        int64_t divisor = truncate_value(rhs.buffer, rhs.size, rhs.is_signed);
+        bool is_signed = op->binop.op == Div || op->binop.op == Mod;
+        return divisor == 0 || (is_signed && divisor == -1);
+    }
+    return op->type == Unary && op->unary.op == Deref;
+}
+
+// Calls may do anything, and a dereference or a division may fault, so
+// they are kept even when nobody reads what they produce
+static bool op_has_side_effects(Op* op) {
+    switch (op->type) {
+        case AssignLocal:
+        case Select: return false;
+        case Binary:
+        case Unary: return op_may_trap(op);
+        default: return true;
+    }
+}
+
+static bool op_ends_block(Op* op) {
+    switch (op->type) {
+        case RtReturn:
+        case TailCall:
+        case JumpIfNot:
+        case JumpIf:
+        case Jump: return true;
+        default: return false;
+    }
+}
+
+static long slot_index(RoutineBody* rt, Arg arg) {
+    if (arg.type != Position) return -1;
+    long index = hmgeti(rt->slots, arg.position);
+    if (index == -1) return -1;
+    return rt->slots[index].value;
+}
+
+static bool fits_int32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool same_slot(Arg a, Arg b) {
+    return a.type == Position && b.type == Position && a.position == b.position;
+}
+
+static bool op_touches_slot(Op* op, Arg slot) {
+    Arg* dst = op_dst(op);
+    if (dst && same_slot(*dst, slot)) return true;
+
+    Arg* args[MAX_OP_ARGS];
+    size_t count = op_args(op, args);
+    for (size_t i = 0; i < count; ++i) {
+        if (same_slot(*args[i], slot)) return true;
+    }
+
+    return false;
+}
+
+static void free_analysis(RoutineBody* rt) {
+    for (size_t i = 0; i < arrlenu(rt->blocks); ++i) {
+        arrfree(rt->blocks[i].succs);
+        arrfree(rt->blocks[i].preds);
+        if (rt->live_in) free(rt->live_in[i]);
+        if (rt->live_out) free(rt->live_out[i]);
+    }
+
+    for (size_t i = 0; rt->dominators && i < arrlenu(rt->blocks); ++i) free(rt->dominators[i]);
+    free(rt->dominators);
+    free(rt->reachable);
+    rt->dominators = NULL;
+    rt->reachable = NULL;
+
+    arrfree(rt->blocks);
+    hmfree(rt->labels);
+    hmfree(rt->slots);
+    arrfree(rt->escaped);
+    free(rt->live_in);
+    free(rt->live_out);
+
+    rt->live_in = NULL;
+    rt->live_out = NULL;
+    rt->words = 0;
+}
+
+static void collect_slots(RoutineBody* rt) {
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        Arg* args[MAX_OP_ARGS];
+        size_t count = op_args(op, args);
+
+        Arg* dst = op_dst(op);
+        if (dst) args[count++] = dst;
+
+        if (op->type == NewRoutine) {
+            for (size_t j = 0; j < arrlenu(op->new_routine.args); ++j) {
+                args[count++] = &op->new_routine.args[j];
+            }
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            if (args[j]->type != Position || hmgeti(rt->slots, args[j]->position) != -1) continue;
+            size_t slot = hmlenu(rt->slots);
+            hmput(rt->slots, args[j]->position, slot);
+            arrpush(rt->escaped, false);
+        }
+
+        if (op->type == Unary && op->unary.op == Ref) {
+            long slot = slot_index(rt, op->unary.arg);
+            if (slot != -1) rt->escaped[slot] = true;
+        }
+    }
+
+    rt->words = (hmlenu(rt->slots) + 63) / 64;
+}
+
+static void build_cfg(RoutineBody* rt) {
+    size_t len = arrlenu(rt->ops);
+    size_t start = 1;
+
+    for (size_t i = 1; i < len; ++i) {
+        bool last = i + 1 == len;
+        bool next_is_label = !last && rt->ops[i + 1].type == Label;
+
+        if (rt->ops[i].type == Label) hmput(rt->labels, rt->ops[i].label.index, arrlenu(rt->blocks));
+
+        if (last || next_is_label || op_ends_block(&rt->ops[i])) {
+            Block block = { .start = start, .end = i + 1 };
+            arrpush(rt->blocks, block);
+            start = i + 1;
+        }
+    }
+
+    size_t blocks = arrlenu(rt->blocks);
+    for (size_t i = 0; i < blocks; ++i) {
+        Op* last = &rt->ops[rt->blocks[i].end - 1];
+        bool falls_through = true;
+
+        switch (last->type) {
+            case Jump: {
+                arrpush(rt->blocks[i].succs, hmget(rt->labels, last->jump.label));
+                falls_through = false;
+            } break;
+            case JumpIfNot: arrpush(rt->blocks[i].succs, hmget(rt->labels, last->jump_if_not.label)); break;
+            case JumpIf: arrpush(rt->blocks[i].succs, hmget(rt->labels, last->jump_if.label)); break;
+            case RtReturn:
+            case TailCall: falls_through = false; break;
+            default: break;
+        }
+
+        if (falls_through && i + 1 < blocks) arrpush(rt->blocks[i].succs, i + 1);
+
+        for (size_t j = 0; j < arrlenu(rt->blocks[i].succs); ++j) {
+            arrpush(rt->blocks[rt->blocks[i].succs[j]].preds, i);
+        }
+    }
+}
+
+static void compute_liveness(RoutineBody* rt) {
+    size_t blocks = arrlenu(rt->blocks);
+    uint64_t** uses = calloc(blocks, sizeof(uint64_t*));
+    uint64_t** defs = calloc(blocks, sizeof(uint64_t*));
+
+    rt->live_in = calloc(blocks, sizeof(uint64_t*));
+    rt->live_out = calloc(blocks, sizeof(uint64_t*));
+
+    for (size_t b = 0; b < blocks; ++b) {
+        uses[b] = bitset_new(rt->words);
+        defs[b] = bitset_new(rt->words);
+        rt->live_in[b] = bitset_new(rt->words);
+        rt->live_out[b] = bitset_new(rt->words);
+
+        for (size_t i = rt->blocks[b].start; i < rt->blocks[b].end; ++i) {
+            Arg* args[MAX_OP_ARGS];
+            size_t count = op_args(&rt->ops[i], args);
+
+            for (size_t j = 0; j < count; ++j) {
+                long slot = slot_index(rt, *args[j]);
+                if (slot != -1 && !bitset_test(defs[b], slot)) bitset_set(uses[b], slot);
+            }
+
+            Arg* dst = op_dst(&rt->ops[i]);
+            long slot = dst ? slot_index(rt, *dst) : -1;
+            if (slot != -1) bitset_set(defs[b], slot);
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (size_t b = blocks; b-- > 0;) {
+            for (size_t j = 0; j < arrlenu(rt->blocks[b].succs); ++j) {
+                changed |= bitset_union(rt->live_out[b], rt->live_in[rt->blocks[b].succs[j]], rt->words);
+            }
+
+            for (size_t w = 0; w < rt->words; ++w) {
+                uint64_t in = uses[b][w] | (rt->live_out[b][w] & ~defs[b][w]);
+                changed |= in != rt->live_in[b][w];
+                rt->live_in[b][w] = in;
+            }
+        }
+    }
+
+    for (size_t b = 0; b < blocks; ++b) {
+        free(uses[b]);
+        free(defs[b]);
+    }
+
+    free(uses);
+    free(defs);
+}
+
+static void mark_reachable(RoutineBody* rt, size_t block) {
+    if (rt->reachable[block]) return;
+    rt->reachable[block] = true;
+    for (size_t i = 0; i < arrlenu(rt->blocks[block].succs); ++i) mark_reachable(rt, rt->blocks[block].succs[i]);
+}
+
+static void compute_dominators(RoutineBody* rt) {
+    size_t blocks = arrlenu(rt->blocks);
+    rt->block_words = (blocks + 63) / 64;
+    rt->reachable = calloc(blocks + 1, sizeof(bool));
+    rt->dominators = calloc(blocks + 1, sizeof(uint64_t*));
+    if (blocks > 0) mark_reachable(rt, 0);
+
+    for (size_t b = 0; b < blocks; ++b) {
+        rt->dominators[b] = bitset_new(rt->block_words);
+        if (b == 0) bitset_set(rt->dominators[b], b);
+        else memset(rt->dominators[b], 0xff, rt->block_words * sizeof(uint64_t));
+    }
+
+    uint64_t* current = bitset_new(rt->block_words);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (size_t b = 1; b < blocks; ++b) {
+            if (!rt->reachable[b]) continue;
+
+            memset(current, 0xff, rt->block_words * sizeof(uint64_t));
+            for (size_t p = 0; p < arrlenu(rt->blocks[b].preds); ++p) {
+                size_t pred = rt->blocks[b].preds[p];
+                if (!rt->reachable[pred]) continue;
+                for (size_t w = 0; w < rt->block_words; ++w) current[w] &= rt->dominators[pred][w];
+            }
+            bitset_set(current, b);
+
+            changed |= memcmp(current, rt->dominators[b], rt->block_words * sizeof(uint64_t)) != 0;
+            memcpy(rt->dominators[b], current, rt->block_words * sizeof(uint64_t));
+        }
+    }
+
+    free(current);
+}
+
+static bool dominates(RoutineBody* rt, size_t a, size_t b) {
+    return rt->reachable[b] && bitset_test(rt->dominators[b], a);
+}
+
+static void analyze_routine(RoutineBody* rt) {
+    free_analysis(rt);
+    collect_slots(rt);
+    build_cfg(rt);
+    compute_liveness(rt);
+    compute_dominators(rt);
+}
+
+static void free_loops(Loop* loops) {
+    for (size_t i = 0; i < arrlenu(loops); ++i) {
+        free(loops[i].body);
+        arrfree(loops[i].blocks);
+    }
+    arrfree(loops);
+}
+
+static void add_loop_block(RoutineBody* rt, Loop* loop, size_t block) {
+    if (bitset_test(loop->body, block)) return;
+    bitset_set(loop->body, block);
+    arrpush(loop->blocks, block);
+
+    for (size_t p = 0; p < arrlenu(rt->blocks[block].preds); ++p) {
+        size_t pred = rt->blocks[block].preds[p];
+        if (rt->reachable[pred]) add_loop_block(rt, loop, pred);
+    }
+}
+
+// Natural loops, one per header, sorted from the innermost outwards
+static Loop* find_loops(RoutineBody* rt) {
+    Loop* loops = NULL;
+
+    for (size_t b = 0; b < arrlenu(rt->blocks); ++b) {
+        for (size_t s = 0; s < arrlenu(rt->blocks[b].succs); ++s) {
+            size_t header = rt->blocks[b].succs[s];
+            if (!dominates(rt, header, b)) continue;
+
+            Loop* loop = NULL;
+            for (size_t l = 0; l < arrlenu(loops); ++l) {
+                if (loops[l].header == header) loop = &loops[l];
+            }
+
+            if (loop == NULL) {
+                arrpush(loops, ((Loop) { .header = header, .body = bitset_new(rt->block_words) }));
+                loop = &arrlast(loops);
+                bitset_set(loop->body, header);
+                arrpush(loop->blocks, header);
+            }
+
+            add_loop_block(rt, loop, b);
+        }
+    }
+
+    for (size_t i = 1; i < arrlenu(loops); ++i) {
+        for (size_t j = i; j > 0 && arrlenu(loops[j].blocks) < arrlenu(loops[j - 1].blocks); --j) {
+            Loop temp = loops[j];
+            loops[j] = loops[j - 1];
+            loops[j - 1] = temp;
+        }
+    }
+
+    return loops;
+}
+
+static bool in_loop(Loop* loop, size_t block) {
+    return bitset_test(loop->body, block);
+}
+
+// Where code that has to run once before the loop can be inserted: right
+// before the header label, provided the only way into the loop is falling
+// through into it
+static long loop_preheader(RoutineBody* rt, Loop* loop) {
+    Block header = rt->blocks[loop->header];
+
+    for (size_t p = 0; p < arrlenu(header.preds); ++p) {
+        size_t pred = header.preds[p];
+        if (in_loop(loop, pred)) continue;
+        if (pred + 1 != loop->header) return -1;
+
+        Op* last = &rt->ops[rt->blocks[pred].end - 1];
+        if (last->type == Jump) return -1;
+        if (last->type == JumpIfNot && hmget(rt->labels, last->jump_if_not.label) == loop->header) return -1;
+        if (last->type == JumpIf && hmget(rt->labels, last->jump_if.label) == loop->header) return -1;
+    }
+
+    return header.start;
+}
+
+static bool loop_writes_memory(RoutineBody* rt, Loop* loop) {
+    for (size_t i = 0; i < arrlenu(loop->blocks); ++i) {
+        Block block = rt->blocks[loop->blocks[i]];
+        for (size_t j = block.start; j < block.end; ++j) {
+            Op* op = &rt->ops[j];
+            Arg* dst = op_dst(op);
+            long slot = dst ? slot_index(rt, *dst) : -1;
+            if (op->type == RoutineCall || (slot != -1 && rt->escaped[slot])) return true;
+        }
+    }
+
+    return false;
+}
+
+// How many times each slot is written inside the loop, and by which op
+static void count_loop_defs(RoutineBody* rt, Loop* loop, size_t* defs, size_t* def_op) {
+    for (size_t i = 0; i < arrlenu(loop->blocks); ++i) {
+        Block block = rt->blocks[loop->blocks[i]];
+        for (size_t j = block.start; j < block.end; ++j) {
+            Arg* dst = op_dst(&rt->ops[j]);
+            long slot = dst ? slot_index(rt, *dst) : -1;
+            if (slot == -1) continue;
+            defs[slot] += 1;
+            def_op[slot] = j;
+        }
+    }
+}
+
+// Blocks leaving the loop, either by branching out of it or by returning
+static bool dominates_loop_exits(RoutineBody* rt, Loop* loop, size_t block) {
+    for (size_t i = 0; i < arrlenu(loop->blocks); ++i) {
+        size_t b = loop->blocks[i];
+        Op* last = &rt->ops[rt->blocks[b].end - 1];
+        bool exits = last->type == RtReturn || last->type == TailCall;
+        for (size_t s = 0; s < arrlenu(rt->blocks[b].succs); ++s) exits |= !in_loop(loop, rt->blocks[b].succs[s]);
+        if (exits && !dominates(rt, block, b)) return false;
+    }
+
+    return true;
+}
+
+static size_t remove_marked_ops(RoutineBody* rt, bool* marked) {
+    size_t removed = 0;
+    size_t len = arrlenu(rt->ops);
+    Op* ops = NULL;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (marked[i]) {
+            free_op(rt->ops[i]);
+            removed += 1;
+        } else {
+            arrpush(ops, rt->ops[i]);
+        }
+    }
+
+    arrfree(rt->ops);
+    rt->ops = ops;
+    return removed;
+}
+
+// arrins and arrinsn mix signed and unsigned lengths in their expansion,
+// which -Wextra reports at every use, so ops are added at the end and the
+// tail moved over them instead
+static void insert_ops(Op** ops, size_t at, Op* with, size_t count) {
+    if (count == 0) return;
+
+    arraddnptr(*ops, count);
+    memmove(&(*ops)[at + count], &(*ops)[at], (arrlenu(*ops) - count - at) * sizeof(Op));
+    memcpy(&(*ops)[at], with, count * sizeof(Op));
+}
+
+static void insert_op(Op** ops, size_t at, Op op) {
+    insert_ops(ops, at, &op, 1);
+}
+
+static size_t dead_code_elimination(RoutineBody* rt) {
+    size_t removed = 0;
+
+    while (true) {
+        analyze_routine(rt);
+
+        size_t len = arrlenu(rt->ops);
+        bool* dead = calloc(len, sizeof(bool));
+        uint64_t* live = bitset_new(rt->words);
+
+        for (size_t b = 0; b < arrlenu(rt->blocks); ++b) {
+            memcpy(live, rt->live_out[b], rt->words * sizeof(uint64_t));
+
+            for (size_t i = rt->blocks[b].end; i-- > rt->blocks[b].start;) {
+                Op* op = &rt->ops[i];
+                Arg* dst = op_dst(op);
+                long slot = dst ? slot_index(rt, *dst) : -1;
+
+                if (slot != -1 && !rt->escaped[slot] && !op_has_side_effects(op) && !bitset_test(live, slot)) {
+                    dead[i] = true;
+                    continue;
+                }
+
+                if (slot != -1) bitset_clear(live, slot);
+
+                Arg* args[MAX_OP_ARGS];
+                size_t count = op_args(op, args);
+                for (size_t j = 0; j < count; ++j) {
+                    long used = slot_index(rt, *args[j]);
+                    if (used != -1) bitset_set(live, used);
+                }
+            }
+        }
+
+        size_t count = remove_marked_ops(rt, dead);
+        free(live);
+        free(dead);
+
+        if (count == 0) break;
+        removed += count;
+    }
+
+    return removed;
+}
+
+static size_t* count_slot_uses(RoutineBody* rt) {
+    size_t* uses = calloc(hmlenu(rt->slots) + 1, sizeof(size_t));
+
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        Arg* args[MAX_OP_ARGS];
+        size_t count = op_args(&rt->ops[i], args);
+        for (size_t j = 0; j < count; ++j) {
+            long slot = slot_index(rt, *args[j]);
+            if (slot != -1) uses[slot] += 1;
+        }
+    }
+
+    return uses;
+}
+
+// The codegen stores a binop result with the width of its destination, so
+// an Add or Sub can write straight into a narrower variable and get the same
+// truncation the copy would have done. Every other op has to match exactly.
+static bool can_retarget(Op* op, Arg var, Arg temp) {
+    if (var.size == temp.size) return true;
+    if (op->type != Binary || var.size > temp.size) return false;
+    return op->binop.op == Add || op->binop.op == Sub;
+}
+
+static long find_single_use(RoutineBody* rt, Block block, size_t def, Arg temp) {
+    for (size_t i = def + 1; i < block.end; ++i) {
+        Arg* args[MAX_OP_ARGS];
+        size_t count = op_args(&rt->ops[i], args);
+        for (size_t j = 0; j < count; ++j) {
+            if (same_slot(*args[j], temp)) return i;
+        }
+    }
+
+    return -1;
+}
+
+// t = a op b; v = t  ->  v = a op b
+static size_t coalesce_temporaries(RoutineBody* rt) {
+    analyze_routine(rt);
+
+    size_t* uses = count_slot_uses(rt);
+    bool* removed = calloc(arrlenu(rt->ops), sizeof(bool));
+
+    for (size_t b = 0; b < arrlenu(rt->blocks); ++b) {
+        Block block = rt->blocks[b];
+
+        for (size_t i = block.start; i < block.end; ++i) {
+            Arg* temp = op_dst(&rt->ops[i]);
+            if (temp == NULL || rt->ops[i].type == AssignLocal) continue;
+
+            long slot = slot_index(rt, *temp);
+            if (slot == -1 || rt->escaped[slot] || uses[slot] != 1) continue;
+
+            long use = find_single_use(rt, block, i, *temp);
+            if (use == -1 || rt->ops[use].type != AssignLocal) continue;
+
+            Op* copy = &rt->ops[use];
+            Arg var = copy->assign_loc.offset_dst;
+            long var_slot = slot_index(rt, var);
+            if (var_slot == -1 || !same_slot(copy->assign_loc.arg, *temp)) continue;
+            if (!can_retarget(&rt->ops[i], var, *temp)) continue;
+
+            // The variable now gets its value earlier than before, so nothing
+            // in between may observe or overwrite it
+            bool observed = false;
+            for (size_t j = i + 1; j < (size_t)use && !observed; ++j) {
+                observed = op_touches_slot(&rt->ops[j], var);
+                if (rt->escaped[var_slot]) observed |= op_has_side_effects(&rt->ops[j]);
+            }
+            if (observed) continue;
+
+            *temp = var;
+            removed[use] = true;
+        }
+    }
+
+    size_t coalesced = remove_marked_ops(rt, removed);
+    free(removed);
+    free(uses);
+    return coalesced;
+}
+
+static bool is_copy(RoutineBody* rt, Op* op) {
+    if (op->type != AssignLocal) return false;
+
+    Arg dst = op->assign_loc.offset_dst;
+    Arg src = op->assign_loc.arg;
+    long slot = slot_index(rt, dst);
+    if (slot == -1 || rt->escaped[slot]) return false;
+
+    switch (src.type) {
+        case Position: {
+            long src_slot = slot_index(rt, src);
+            return src_slot != -1 && !rt->escaped[src_slot] && src.position != dst.position && src.size == dst.size;
+        }
+        case Value: return true;
+        case Offset: return dst.size == QWord;
+        default: return false;
+    }
+}
+
+// Not every op can encode every kind of operand: only Positions can be
+// dereferenced and string offsets are only loaded with movabs
+static bool accepts_arg(Op* op, Arg* use, Arg arg) {
+    switch (arg.type) {
+        case Position: return op->type != Unary || op->unary.op != Ref;
+        case Value: return op->type != Unary && fits_int32(arg.buffer);
+        case Offset: return op->type == RoutineCall || op->type == TailCall || op->type == RtReturn || (op->type == AssignLocal && use == &op->assign_loc.arg);
+        default: return false;
+    }
+}
+
+static Arg propagated_arg(Arg copy_dst, Arg copy_src, Arg use) {
+    Arg result = copy_src;
+    result.size = use.size;
+    result.is_signed = use.is_signed;
+
+    if (copy_src.type == Value) {
+        int64_t stored = truncate_value(copy_src.buffer, copy_dst.size, copy_dst.is_signed);
+        result.buffer = truncate_value(stored, use.size, use.is_signed);
+    }
+
+    // The signedness of an Offset tells whether it owns its string
+    if (copy_src.type == Offset) {
+        result.size = QWord;
+        result.is_signed = copy_src.is_signed;
+    }
+    return result;
+}
+
+// Facts are "this op's result still holds" statements used by the forward
+// passes. A fact is generated by its op and killed by any later write to a
+// slot it mentions; at a join only the facts holding on every incoming path
+// survive, so a fact reaching an op was generated in a dominating block.
+typedef struct {
+    size_t* ops;
+    IndexHashmap* of_op;
+    uint64_t** slot_kills;
+    uint64_t* memory_kills;
+    uint64_t** in;
+    size_t words;
+} Facts;
+
+static void facts_add(Facts* facts, size_t op_index) {
+    size_t fact = arrlenu(facts->ops);
+    arrpush(facts->ops, op_index);
+    hmput(facts->of_op, op_index, fact);
+}
+
+static void facts_kill_on(Facts* facts, size_t fact, long slot) {
+    if (slot != -1) bitset_set(facts->slot_kills[slot], fact);
+}
+
+static void facts_prepare(RoutineBody* rt, Facts* facts) {
+    size_t slots = hmlenu(rt->slots);
+    facts->words = (arrlenu(facts->ops) + 63) / 64;
+    facts->slot_kills = calloc(slots, sizeof(uint64_t*));
+    for (size_t s = 0; s < slots; ++s) facts->slot_kills[s] = bitset_new(facts->words);
+    facts->memory_kills = bitset_new(facts->words);
+}
+
+static void facts_transfer(RoutineBody* rt, Facts* facts, uint64_t* current, size_t op_index) {
+    Op* op = &rt->ops[op_index];
+    Arg* dst = op_dst(op);
+    long slot = dst ? slot_index(rt, *dst) : -1;
+    bool memory = op->type == RoutineCall || (slot != -1 && rt->escaped[slot]);
+
+    for (size_t w = 0; w < facts->words; ++w) {
+        if (slot != -1) current[w] &= ~facts->slot_kills[slot][w];
+        if (memory) current[w] &= ~facts->memory_kills[w];
+    }
+
+    long fact = hmgeti(facts->of_op, op_index);
+    if (fact != -1) bitset_set(current, facts->of_op[fact].value);
+}
+
+static void facts_solve(RoutineBody* rt, Facts* facts) {
+    size_t blocks = arrlenu(rt->blocks);
+    size_t words = facts->words;
+    uint64_t** out = calloc(blocks, sizeof(uint64_t*));
+
+    facts->in = calloc(blocks, sizeof(uint64_t*));
+    for (size_t b = 0; b < blocks; ++b) {
+        facts->in[b] = bitset_new(words);
+        out[b] = bitset_new(words);
+        memset(out[b], 0xff, words * sizeof(uint64_t));
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (size_t b = 0; b < blocks; ++b) {
+            Block block = rt->blocks[b];
+            uint64_t* in = facts->in[b];
+
+            if (b == 0 || arrlenu(block.preds) == 0) memset(in, 0, words * sizeof(uint64_t));
+            else {
+                memcpy(in, out[block.preds[0]], words * sizeof(uint64_t));
+                for (size_t p = 1; p < arrlenu(block.preds); ++p) {
+                    for (size_t w = 0; w < words; ++w) in[w] &= out[block.preds[p]][w];
+                }
+            }
+
+            uint64_t* current = bitset_new(words);
+            memcpy(current, in, words * sizeof(uint64_t));
+            for (size_t i = block.start; i < block.end; ++i) facts_transfer(rt, facts, current, i);
+
+            changed |= memcmp(current, out[b], words * sizeof(uint64_t)) != 0;
+            free(out[b]);
+            out[b] = current;
+        }
+    }
+
+    for (size_t b = 0; b < blocks; ++b) free(out[b]);
+    free(out);
+}
+
+static void facts_free(RoutineBody* rt, Facts* facts) {
+    for (size_t s = 0; facts->slot_kills && s < hmlenu(rt->slots); ++s) free(facts->slot_kills[s]);
+    for (size_t b = 0; facts->in && b < arrlenu(rt->blocks); ++b) free(facts->in[b]);
+
+    free(facts->slot_kills);
+    free(facts->memory_kills);
+    free(facts->in);
+    hmfree(facts->of_op);
+    arrfree(facts->ops);
+}
+
+static size_t propagate_copies_once(RoutineBody* rt) {
+    analyze_routine(rt);
+
+    Facts facts = {0};
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        if (is_copy(rt, &rt->ops[i])) facts_add(&facts, i);
+    }
+
+    size_t count = arrlenu(facts.ops);
+    if (count == 0) {
+        facts_free(rt, &facts);
+        return 0;
+    }
+
+    facts_prepare(rt, &facts);
+
+    Op* snapshot = NULL;
+    for (size_t f = 0; f < count; ++f) {
+        Op* op = &rt->ops[facts.ops[f]];
+        arrpush(snapshot, *op);
+        facts_kill_on(&facts, f, slot_index(rt, op->assign_loc.offset_dst));
+        facts_kill_on(&facts, f, slot_index(rt, op->assign_loc.arg));
+    }
+
+    facts_solve(rt, &facts);
+
+    size_t propagated = 0;
+    for (size_t b = 0; b < arrlenu(rt->blocks); ++b) {
+        Block block = rt->blocks[b];
+        uint64_t* current = facts.in[b];
+
+        for (size_t i = block.start; i < block.end; ++i) {
+            Op* op = &rt->ops[i];
+            Arg* args[MAX_OP_ARGS];
+            size_t arg_count = op_args(op, args);
+
+            for (size_t a = 0; a < arg_count; ++a) {
+                long slot = slot_index(rt, *args[a]);
+                if (slot == -1) continue;
+
+                for (size_t f = 0; f < count; ++f) {
+                    Op copy = snapshot[f];
+                    if (!bitset_test(current, f) || !same_slot(copy.assign_loc.offset_dst, *args[a])) continue;
+
+                    Arg replacement = propagated_arg(copy.assign_loc.offset_dst, copy.assign_loc.arg, *args[a]);
+                    if (accepts_arg(op, args[a], replacement) && memcmp(&replacement, args[a], sizeof(Arg)) != 0) {
+                        *args[a] = replacement;
+                        propagated += 1;
+                    }
+                    break;
+                }
+            }
+
+            facts_transfer(rt, &facts, current, i);
+        }
+    }
+
+    arrfree(snapshot);
+    facts_free(rt, &facts);
+    return propagated;
+}
+
+static size_t copy_propagation(RoutineBody* rt) {
+    size_t propagated = 0;
+
+    // Every round resolves one more link of a copy chain
+    for (size_t round = 0; round < 16; ++round) {
+        size_t count = propagate_copies_once(rt);
+        if (count == 0) break;
+        propagated += count;
+    }
+
+    // Propagation can turn `a = b; b = a` into a store of a slot to itself
+    bool* removed = calloc(arrlenu(rt->ops), sizeof(bool));
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        removed[i] = op->type == AssignLocal && same_slot(op->assign_loc.offset_dst, op->assign_loc.arg) && op->assign_loc.offset_dst.size == op->assign_loc.arg.size;
+    }
+    remove_marked_ops(rt, removed);
+    free(removed);
+
+    return propagated;
+}
+
+typedef struct {
+    enum { ExprBinary, ExprDeref } kind;
+    BinaryOp op;
+    Arg lhs;
+    Arg rhs;
+    Size size;
+} Expr;
+
+static bool args_equal(Arg a, Arg b) {
+    return a.type == b.type && a.size == b.size && a.is_signed == b.is_signed && a.buffer == b.buffer;
+}
+
+static bool arg_less(Arg a, Arg b) {
+    if (a.type != b.type) return a.type < b.type;
+    if (a.buffer != b.buffer) return a.buffer < b.buffer;
+    if (a.size != b.size) return a.size < b.size;
+    return a.is_signed < b.is_signed;
+}
+
+static bool exprs_equal(Expr a, Expr b) {
+    return a.kind == b.kind && a.op == b.op && a.size == b.size && args_equal(a.lhs, b.lhs) && args_equal(a.rhs, b.rhs);
+}
+
+// The codegen extends each operand with its own type, so swapping them
+// does not change what is computed
+static void normalize_expr(Expr* expr) {
+    if (expr->kind != ExprBinary) return;
+
+    switch (expr->op) {
+        case Gt: expr->op = Lt; break;
+        case Ge: expr->op = Le; break;
+        case UGt: expr->op = ULt; break;
+        case UGe: expr->op = ULe; break;
+        case Add:
+        case Mul:
+        case Eq:
+        case Ne: if (!arg_less(expr->rhs, expr->lhs)) return; break;
+        default: return;
+    }
+
+    Arg temp = expr->lhs;
+    expr->lhs = expr->rhs;
+    expr->rhs = temp;
+}
+
+static bool is_numbered_operand(Arg arg) {
+    return arg.type == Position || arg.type == Value;
+}
+
+static bool op_expr(RoutineBody* rt, Op* op, Expr* expr) {
+    Arg* dst = op_dst(op);
+    long slot = dst ? slot_index(rt, *dst) : -1;
+    if (slot == -1 || rt->escaped[slot]) return false;
+
+    switch (op->type) {
+        case Binary: {
+            Arg lhs = op->binop.lhs;
+            Arg rhs = op->binop.rhs;
+            if (!is_numbered_operand(lhs) || !is_numbered_operand(rhs)) return false;
+            if (same_slot(lhs, *dst) || same_slot(rhs, *dst)) return false;
+            *expr = (Expr) { .kind = ExprBinary, .op = op->binop.op, .lhs = lhs, .rhs = rhs, .size = dst->size };
+        } break;
+        case Unary: {
+            if (op->unary.op != Deref || same_slot(op->unary.arg, *dst)) return false;
+            *expr = (Expr) { .kind = ExprDeref, .lhs = op->unary.arg, .size = dst->size };
+        } break;
+        default: return false;
+    }
+
+    normalize_expr(expr);
+    return true;
+}
+
+// The unsigned comparisons read both values as 64-bit unsigned ones
+static bool comparison_holds(BinaryOp op, int64_t a, int64_t b) {
+    switch (op) {
+        case Lt: return a < b;
+        case Gt: return a > b;
+        case Le: return a <= b;
+        case Ge: return a >= b;
+        case ULt: return (uint64_t)a < (uint64_t)b;
+        case UGt: return (uint64_t)a > (uint64_t)b;
+        case ULe: return (uint64_t)a <= (uint64_t)b;
+        case UGe: return (uint64_t)a >= (uint64_t)b;
+        case Eq: return a == b;
+        case Ne: return a != b;
+        default: UNREACHABLE("Not a comparison");
+    }
+}
+
+// Mirrors what the codegen computes for two immediates of the same width:
+// each is extended with its own type, and a comparison or a division reads
+// the bits of that width as its op says
+static bool fold_binary(Op* op, Arg* result) {
+    Arg lhs = op->binop.lhs;
+    Arg rhs = op->binop.rhs;
+    Arg dst = op->binop.offset_dst;
+
+    if (lhs.type != Value || rhs.type != Value || lhs.size != rhs.size) return false;
+
+    int64_t a = truncate_value(lhs.buffer, lhs.size, lhs.is_signed);
+    int64_t b = truncate_value(rhs.buffer, rhs.size, rhs.is_signed);
+    int64_t sa = truncate_value(a, lhs.size, true);
+    int64_t sb = truncate_value(b, rhs.size, true);
+    uint64_t ua = truncate_value(a, lhs.size, false);
+    uint64_t ub = truncate_value(b, rhs.size, false);
+    uint64_t shift = b & (lhs.size == QWord ? 63 : 31);
+    int64_t value = 0;
+
+    switch (op->binop.op) {
+        case Add: value = (uint64_t)a + (uint64_t)b; break;
+        case Sub: value = (uint64_t)a - (uint64_t)b; break;
+        case Mul: value = (uint64_t)a * (uint64_t)b; break;
+        case Div:
+        case Mod: {
+            if (sb == 0 || (sa == INT64_MIN && sb == -1)) return false;
+            value = op->binop.op == Div ? sa / sb : sa % sb;
+        } break;
+        case UDiv:
+        case UMod: {
+            if (ub == 0) return false;
+            value = op->binop.op == UDiv ? ua / ub : ua % ub;
+        } break;
+        case Lt:
+        case Gt:
+        case Le:
+        case Ge:
+        case Eq:
+        case Ne: value = comparison_holds(op->binop.op, sa, sb); break;
+        case ULt:
+        case UGt:
+        case ULe:
+        case UGe: value = comparison_holds(op->binop.op, ua, ub); break;
+        case LSh: {
+            if (lhs.size != dst.size) return false;
+            value = (uint64_t)a << shift;
+        } break;
+        case RSh: {
+            if (lhs.size != dst.size) return false;
+            value = lhs.is_signed ? a >> shift : (int64_t)(ua >> shift);
+        } break;
+        default: return false;
+    }
+
+    *result = (Arg) {
+        .type = Value,
+        .size = dst.size,
+        .is_signed = true,
+        .buffer = truncate_value(value, dst.size, true)
+    };
+    return true;
+}
+
+static size_t global_value_numbering(RoutineBody* rt) {
+    size_t replaced = 0;
+
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        Arg value = {0};
+        if (op->type == Binary && fold_binary(op, &value)) {
+            *op = OpAssignLocal(op->binop.offset_dst, value);
+            replaced += 1;
+        }
+    }
+
+    analyze_routine(rt);
+
+    Facts facts = {0};
+    Expr* exprs = NULL;
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        Expr expr = {0};
+        if (!op_expr(rt, &rt->ops[i], &expr)) continue;
+        facts_add(&facts, i);
+        arrpush(exprs, expr);
+    }
+
+    size_t count = arrlenu(facts.ops);
+    facts_prepare(rt, &facts);
+
+    Arg* results = NULL;
+    for (size_t f = 0; f < count; ++f) {
+        Op* op = &rt->ops[facts.ops[f]];
+        Arg dst = *op_dst(op);
+        arrpush(results, dst);
+
+        facts_kill_on(&facts, f, slot_index(rt, dst));
+        facts_kill_on(&facts, f, slot_index(rt, exprs[f].lhs));
+        facts_kill_on(&facts, f, slot_index(rt, exprs[f].rhs));
+        if (exprs[f].kind == ExprDeref) bitset_set(facts.memory_kills, f);
+    }
+
+    if (count > 0) facts_solve(rt, &facts);
+
+    for (size_t b = 0; count > 0 && b < arrlenu(rt->blocks); ++b) {
+        Block block = rt->blocks[b];
+        uint64_t* current = facts.in[b];
+
+        for (size_t i = block.start; i < block.end; ++i) {
+            Op* op = &rt->ops[i];
+            Expr expr = {0};
+
+            if (op_expr(rt, op, &expr)) {
+                for (size_t f = 0; f < count; ++f) {
+                    if (!bitset_test(current, f) || !exprs_equal(exprs[f], expr)) continue;
+
+                    Arg dst = *op_dst(op);
+                    Arg earlier = results[f];
+                    earlier.size = dst.size;
+                    earlier.is_signed = dst.is_signed;
+
+                    free_op(*op);
+                    *op = OpAssignLocal(dst, earlier);
+                    replaced += 1;
+                    break;
+                }
+            }
+
+            facts_transfer(rt, &facts, current, i);
+        }
+    }
+
+    arrfree(results);
+    arrfree(exprs);
+    facts_free(rt, &facts);
+    return replaced;
+}
+
+typedef struct {
+    size_t* defs;
+    size_t* def_op;
+    bool* hoisted;
+    bool writes_memory;
+} LoopInvariants;
+
+static bool is_invariant_arg(RoutineBody* rt, LoopInvariants* inv, Arg arg) {
+    if (arg.type == Value) return true;
+
+    long slot = slot_index(rt, arg);
+    if (slot == -1) return false;
+    return inv->defs[slot] == 0 || (inv->defs[slot] == 1 && inv->hoisted[inv->def_op[slot]]);
+}
+
+static bool is_hoistable(RoutineBody* rt, Loop* loop, LoopInvariants* inv, size_t block, size_t index) {
+    Op* op = &rt->ops[index];
+    Arg* dst = op_dst(op);
+    long slot = dst ? slot_index(rt, *dst) : -1;
+
+    if (slot == -1 || rt->escaped[slot] || inv->defs[slot] != 1) return false;
+    if (bitset_test(rt->live_in[loop->header], slot)) return false;
+
+    switch (op->type) {
+        case Binary: {
+            if (op_may_trap(op) && !dominates_loop_exits(rt, loop, block)) return false;
+            return is_invariant_arg(rt, inv, op->binop.lhs) && is_invariant_arg(rt, inv, op->binop.rhs);
+        }
+        case Unary: {
+            if (op->unary.op == Ref) return true;
+            if (op->unary.op != Deref || inv->writes_memory) return false;
+            // A load is only moved when the loop would have executed it
+            // anyway, otherwise it could fault on a path that never read it
+            return dominates_loop_exits(rt, loop, block) && is_invariant_arg(rt, inv, op->unary.arg);
+        }
+        default: return false;
+    }
+}
+
+static size_t hoist_loop_invariants(RoutineBody* rt, Loop* loop) {
+    long preheader = loop_preheader(rt, loop);
+    if (preheader == -1) return 0;
+
+    size_t len = arrlenu(rt->ops);
+    size_t slots = hmlenu(rt->slots);
+    LoopInvariants inv = {
+        .defs = calloc(slots + 1, sizeof(size_t)),
+        .def_op = calloc(slots + 1, sizeof(size_t)),
+        .hoisted = calloc(len, sizeof(bool)),
+        .writes_memory = loop_writes_memory(rt, loop)
+    };
+
+    count_loop_defs(rt, loop, inv.defs, inv.def_op);
+
+    size_t count = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (size_t i = 0; i < arrlenu(loop->blocks); ++i) {
+            size_t b = loop->blocks[i];
+            for (size_t j = rt->blocks[b].start; j < rt->blocks[b].end; ++j) {
+                if (inv.hoisted[j] || !is_hoistable(rt, loop, &inv, b, j)) continue;
+                inv.hoisted[j] = true;
+                changed = true;
+                count += 1;
+            }
+        }
+    }
+
+    if (count > 0) {
+        Op* ops = NULL;
+        for (size_t i = 0; i < len; ++i) {
+            if (i == (size_t)preheader) {
+                for (size_t j = 0; j < len; ++j) {
+                    if (inv.hoisted[j]) arrpush(ops, rt->ops[j]);
+                }
+            }
+            if (!inv.hoisted[i]) arrpush(ops, rt->ops[i]);
+        }
+
+        arrfree(rt->ops);
+        rt->ops = ops;
+    }
+
+    free(inv.defs);
+    free(inv.def_op);
+    free(inv.hoisted);
+    return count;
+}
+
+static size_t loop_invariant_code_motion(RoutineBody* rt) {
+    size_t hoisted = 0;
+
+    while (true) {
+        analyze_routine(rt);
+        Loop* loops = find_loops(rt);
+
+        size_t count = 0;
+        for (size_t i = 0; i < arrlenu(loops) && count == 0; ++i) {
+            count = hoist_loop_invariants(rt, &loops[i]);
+        }
+
+        free_loops(loops);
+        if (count == 0) break;
+        hoisted += count;
+    }
+
+    return hoisted;
+}
+
+// A slot whose only write in the loop is stepping itself by a constant
+typedef struct {
+    Arg var;
+    size_t update;
+    int64_t step;
+} Induction;
+
+// Fresh stack slot shaped like the given one, carved off the frame
+static Arg new_slot(RoutineBody* rt, Arg like) {
+    rt->ops[0].new_routine.bytes += (size_t)1 << like.size;
+    like.type = Position;
+    like.position = rt->ops[0].new_routine.bytes;
+    return like;
+}
+
+static size_t new_label() {
+    return next_label++;
+}
+
+static bool is_loop_constant(RoutineBody* rt, size_t* defs, Arg arg) {
+    long slot = slot_index(rt, arg);
+    return slot != -1 && !rt->escaped[slot] && defs[slot] == 0;
+}
+
+static Induction* find_inductions(RoutineBody* rt, size_t* defs, size_t* def_op) {
+    Induction* ivs = NULL;
+
+    for (size_t slot = 0; slot < hmlenu(rt->slots); ++slot) {
+        if (defs[slot] != 1 || rt->escaped[slot]) continue;
+
+        Op* op = &rt->ops[def_op[slot]];
+        if (op->type != Binary || (op->binop.op != Add && op->binop.op != Sub)) continue;
+
+        Arg var = op->binop.offset_dst;
+        Arg rhs = op->binop.rhs;
+        if (!same_slot(var, op->binop.lhs) || var.size != op->binop.lhs.size || rhs.type != Value) continue;
+
+        int64_t step = truncate_value(rhs.buffer, rhs.size, true);
+        if (op->binop.op == Sub) step = -step;
+        arrpush(ivs, ((Induction) { .var = var, .update = def_op[slot], .step = step }));
+    }
+
+    return ivs;
+}
+
+static Induction* induction_of(Induction* ivs, Arg arg) {
+    for (size_t i = 0; i < arrlenu(ivs); ++i) {
+        if (same_slot(ivs[i].var, arg)) return &ivs[i];
+    }
+    return NULL;
+}
+
+// t = base + i or t = i * c, recomputed from the counter on every iteration.
+// Mixed widths are only followed for pointer arithmetic, where a QWord base
+// is offset by a narrower index.
+static Induction* derived_induction(RoutineBody* rt, Loop* loop, size_t* defs, Induction* ivs, Op* op, Arg* base) {
+    if (op->type != Binary) return NULL;
+
+    Arg dst = op->binop.offset_dst;
+    long slot = slot_index(rt, dst);
+    if (slot == -1 || rt->escaped[slot] || defs[slot] != 1) return NULL;
+    if (bitset_test(rt->live_in[loop->header], slot)) return NULL;
+
+    Arg lhs = op->binop.lhs;
+    Arg rhs = op->binop.rhs;
+
+    switch (op->binop.op) {
+        case Add: {
+            Induction* iv = induction_of(ivs, lhs);
+            *base = rhs;
+            if (iv == NULL) {
+                iv = induction_of(ivs, rhs);
+                *base = lhs;
+            }
+
+            if (iv == NULL || !is_loop_constant(rt, defs, *base)) return NULL;
+            if (lhs.size == rhs.size && rhs.size == dst.size) return iv;
+            return dst.size == QWord && base->size == QWord ? iv : NULL;
+        }
+        case Mul: {
+            if (rhs.type != Value || dst.size < lhs.size) return NULL;
+            return induction_of(ivs, lhs);
+        }
+        default: return NULL;
+    }
+}
+
+static bool is_comparison(BinaryOp op) {
+    return op >= Lt && op <= Ne;
+}
+
+static bool is_unsigned_comparison(BinaryOp op) {
+    return op >= ULt && op <= UGe;
+}
+
+// The exit test can be moved onto a pointer derived from the counter when
+// the loop reads the counter for nothing else, leaving the counter dead
+static bool only_compared(RoutineBody* rt, Loop* loop, size_t* defs, Induction* iv, size_t derived) {
+    for (size_t i = 0; i < arrlenu(loop->blocks); ++i) {
+        Block block = rt->blocks[loop->blocks[i]];
+
+        for (size_t j = block.start; j < block.end; ++j) {
+            Op* op = &rt->ops[j];
+            if (j == iv->update || j == derived || !op_touches_slot(op, iv->var)) continue;
+            if (op->type != Binary || !is_comparison(op->binop.op) || !same_slot(op->binop.lhs, iv->var)) return false;
+
+            Arg limit = op->binop.rhs;
+            if (!(limit.type == Value && fits_int32(limit.buffer)) && !is_loop_constant(rt, defs, limit)) return false;
+        }
+    }
+
+    return true;
+}
+
+static Arg replace_induction(Arg arg, Induction* iv, Arg with) {
+    return same_slot(arg, iv->var) ? with : arg;
+}
+
+// t = base + i  ->  t = p, with p = base + i before the loop and p stepped
+// next to i, so address computations turn into pointer increments and
+// multiplications by the counter into additions
+static size_t reduce_derived_induction(RoutineBody* rt, Loop* loop, long preheader, size_t* defs, Induction* iv, size_t index, Arg base) {
+    Op derived = rt->ops[index];
+    Arg dst = derived.binop.offset_dst;
+    if (iv->update < (size_t)preheader) return 0;
+
+    bool mul = derived.binop.op == Mul;
+    Arg shape = dst;
+
+    int64_t scale = mul ? truncate_value(derived.binop.rhs.buffer, derived.binop.rhs.size, derived.binop.rhs.is_signed) : 1;
+    int64_t delta = truncate_value((uint64_t)scale * (uint64_t)iv->step, shape.size, true);
+    if (!fits_int32(delta)) return 0;
+
+    bool address = derived.binop.op == Add && dst.size == QWord && base.size == QWord;
+    bool rewrite_exit = address && only_compared(rt, loop, defs, iv, index);
+
+    Arg pointer = new_slot(rt, shape);
+    Arg step = { .type = Value, .size = shape.size, .is_signed = true, .buffer = delta };
+
+    Op* inits = NULL;
+    Op init = derived;
+    init.binop.offset_dst = pointer;
+    arrpush(inits, init);
+
+    size_t count = 1;
+    for (size_t i = 0; rewrite_exit && i < arrlenu(loop->blocks); ++i) {
+        Block block = rt->blocks[loop->blocks[i]];
+
+        for (size_t j = block.start; j < block.end; ++j) {
+            Op* op = &rt->ops[j];
+            if (j == index || op->type != Binary || !is_comparison(op->binop.op) || !same_slot(op->binop.lhs, iv->var)) continue;
+
+            Arg limit = new_slot(rt, dst);
+            Arg bound = op->binop.rhs;
+            arrpush(inits, OpBinary(limit, Add, replace_induction(derived.binop.lhs, iv, bound), replace_induction(derived.binop.rhs, iv, bound)));
+
+            op->binop.lhs = pointer;
+            op->binop.rhs = limit;
+            count += 1;
+        }
+    }
+
+    rt->ops[index] = OpAssignLocal(dst, pointer);
+    insert_op(&rt->ops, iv->update + 1, OpBinary(pointer, Add, pointer, step));
+    insert_ops(&rt->ops, preheader, inits, arrlenu(inits));
+
+    arrfree(inits);
+    return count;
+}
+
+// Counters nobody reads anymore, except to step themselves
+static size_t remove_dead_inductions(RoutineBody* rt, Loop* loop, Induction* ivs) {
+    bool* dead = calloc(arrlenu(rt->ops), sizeof(bool));
+    size_t count = 0;
+
+    for (size_t v = 0; v < arrlenu(ivs); ++v) {
+        long slot = slot_index(rt, ivs[v].var);
+        bool used = false;
+
+        for (size_t i = 0; i < arrlenu(loop->blocks) && !used; ++i) {
+            size_t b = loop->blocks[i];
+
+            for (size_t j = rt->blocks[b].start; j < rt->blocks[b].end && !used; ++j) {
+                used = j != ivs[v].update && op_touches_slot(&rt->ops[j], ivs[v].var);
+            }
+
+            for (size_t s = 0; s < arrlenu(rt->blocks[b].succs) && !used; ++s) {
+                size_t succ = rt->blocks[b].succs[s];
+                used = !in_loop(loop, succ) && bitset_test(rt->live_in[succ], slot);
+            }
+        }
+
+        if (used) continue;
+        dead[ivs[v].update] = true;
+        count += 1;
+    }
+
+    remove_marked_ops(rt, dead);
+    free(dead);
+    return count;
+}
+
+static size_t reduce_loop_inductions(RoutineBody* rt, Loop* loop) {
+    long preheader = loop_preheader(rt, loop);
+    if (preheader == -1) return 0;
+
+    size_t slots = hmlenu(rt->slots);
+    size_t* defs = calloc(slots + 1, sizeof(size_t));
+    size_t* def_op = calloc(slots + 1, sizeof(size_t));
+    count_loop_defs(rt, loop, defs, def_op);
+
+    Induction* ivs = find_inductions(rt, defs, def_op);
+    size_t count = 0;
+
+    for (size_t i = 0; i < arrlenu(loop->blocks) && count == 0; ++i) {
+        Block block = rt->blocks[loop->blocks[i]];
+
+        for (size_t j = block.start; j < block.end && count == 0; ++j) {
+            Arg base = {0};
+            Induction* iv = derived_induction(rt, loop, defs, ivs, &rt->ops[j], &base);
+            if (iv) count = reduce_derived_induction(rt, loop, preheader, defs, iv, j, base);
+        }
+    }
+
+    if (count == 0) count = remove_dead_inductions(rt, loop, ivs);
+
+    arrfree(ivs);
+    free(defs);
+    free(def_op);
+    return count;
+}
+
+static size_t strength_reduction(RoutineBody* rt) {
+    size_t reduced = 0;
+
+    while (true) {
+        analyze_routine(rt);
+        Loop* loops = find_loops(rt);
+
+        size_t count = 0;
+        for (size_t i = 0; i < arrlenu(loops) && count == 0; ++i) {
+            count = reduce_loop_inductions(rt, &loops[i]);
+        }
+
+        free_loops(loops);
+        if (count == 0) break;
+        reduced += count;
+    }
+
+    return reduced;
+}
+
+static RoutineBody* program = NULL;
+
+static bool is_call(Op* op) {
+    return op->type == RoutineCall || op->type == TailCall;
+}
+
+static long find_routine(const char* name) {
+    for (size_t i = 0; i < arrlenu(program); ++i) {
+        if (strcmp(routine_name(&program[i]), name) == 0) return i;
+    }
+    return -1;
+}
+
+static bool calls_reach(size_t from, size_t target, bool* visited) {
+    if (visited[from]) return false;
+    visited[from] = true;
+
+    RoutineBody* rt = &program[from];
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        if (!is_call(&rt->ops[i])) continue;
+        long callee = find_routine(rt->ops[i].routine_call.name);
+        if (callee == -1) continue;
+        if ((size_t)callee == target || calls_reach(callee, target, visited)) return true;
+    }
+
+    return false;
+}
+
+static bool is_recursive(size_t routine) {
+    bool* visited = calloc(arrlenu(program), sizeof(bool));
+    bool result = calls_reach(routine, routine, visited);
+    free(visited);
+    return result;
+}
+
+// What the cost model weighs: every op that turns into instructions
+static size_t routine_cost(RoutineBody* rt) {
+    size_t cost = 0;
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) cost += rt->ops[i].type != Label;
+    return cost;
+}
+
+static bool binds_arguments(RoutineBody* callee, Op* call) {
+    Arg* params = callee->ops[0].new_routine.args;
+    if (arrlenu(call->routine_call.args) != arrlenu(params)) return false;
+
+    for (size_t i = 0; i < arrlenu(params); ++i) {
+        if (call->routine_call.args[i].type == Offset && params[i].size != QWord) return false;
+    }
+
+    return true;
+}
+
+static bool should_inline(RoutineBody* caller, size_t index, Op* call) {
+    RoutineBody* callee = &program[index];
+    Op* routine = &callee->ops[0];
+    Op last = arrlast(callee->ops);
+
+    if (caller == callee || routine->new_routine.inline_hint == InlineNever) return false;
+    if ((last.type != RtReturn && last.type != TailCall) || is_recursive(index)) return false;
+    if (!binds_arguments(callee, call)) return false;
+
+    for (size_t i = 1; i < arrlenu(callee->ops); ++i) {
+        Arg ret = callee->ops[i].return_routine.ret;
+        if (callee->ops[i].type == RtReturn && ret.type == Value && !fits_int32(ret.buffer)) return false;
+    }
+
+    if (routine->new_routine.inline_hint == InlineAlways) return true;
+    return routine_cost(callee) <= options.inline_threshold;
+}
+
+// The caller reads what the call returned straight out of rax, up to the
+// next call that overwrites it
+static void replace_return_value(RoutineBody* rt, size_t start, Arg result) {
+    for (size_t i = start; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        if (op->type == Label) return;
+
+        Arg* args[MAX_OP_ARGS];
+        size_t count = op_args(op, args);
+        for (size_t j = 0; j < count; ++j) {
+            if (args[j]->type != ReturnVal) continue;
+            Arg use = *args[j];
+            *args[j] = result;
+            args[j]->size = use.size;
+            args[j]->is_signed = use.is_signed;
+        }
+
+        if (is_call(op) || op_ends_block(op)) return;
+    }
+}
+
+static bool return_value_read(RoutineBody* rt, size_t start) {
+    for (size_t i = start; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        if (op->type == Label) return false;
+
+        Arg* args[MAX_OP_ARGS];
+        size_t count = op_args(op, args);
+        for (size_t j = 0; j < count; ++j) {
+            if (args[j]->type == ReturnVal) return true;
+        }
+
+        if (is_call(op) || op_ends_block(op)) return false;
+    }
+
+    return false;
+}
+
+// The register is written at the width of the argument and read back at the
+// width of the parameter, so narrower arguments come in zero extended
+static Arg call_argument(Arg arg, Arg param) {
+    if (arg.size < param.size) arg.is_signed = false;
+    return arg;
+}
+
+// Stores the arguments of a call where the callee expects its parameters.
+// Arguments still in rax are read before anything else can clobber it.
+static void bind_arguments(Op** ops, Arg* dsts, Arg* params, Arg* args) {
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < arrlenu(params); ++i) {
+            if ((args[i].type == ReturnVal) != (pass == 0)) continue;
+            arrpush(*ops, OpAssignLocal(dsts[i], call_argument(args[i], params[i])));
+        }
+    }
+}
+
+// Mirrors routine_epilog, where a missing value (or one in position 0)
+// comes back as 0 and a narrower value is zero extended into rax
+static Arg returned_value(Arg ret, size_t base) {
+    if (ret.type == ReturnVal) return ret;
+    if (ret.position == 0) return (Arg) { .type = Value, .size = QWord, .is_signed = true, .buffer = 0 };
+    if (ret.type == Position) {
+        ret.position += base;
+        ret.is_signed = false;
+    }
+    return ret;
+}
+
+static size_t renamed_label(IndexHashmap** labels, size_t label) {
+    long index = hmgeti(*labels, label);
+    if (index != -1) return (*labels)[index].value;
+
+    size_t renamed = new_label();
+    hmput(*labels, label, renamed);
+    return renamed;
+}
+
+// The callee's frame is appended to the caller's, its labels are renamed and
+// every return becomes a store of the result followed by a jump to the end
+static size_t inline_call(RoutineBody* rt, size_t call, RoutineBody* callee) {
+    Op site = rt->ops[call];
+    Arg* params = callee->ops[0].new_routine.args;
+    Arg* args = site.routine_call.args;
+
+    size_t base = rt->ops[0].new_routine.bytes;
+    rt->ops[0].new_routine.bytes += callee->ops[0].new_routine.bytes;
+    Arg result = new_slot(rt, (Arg) { .type = Position, .size = QWord });
+    size_t end = new_label();
+
+    replace_return_value(rt, call + 1, result);
+
+    Op* body = NULL;
+    IndexHashmap* labels = NULL;
+
+    Arg* dsts = NULL;
+    for (size_t i = 0; i < arrlenu(params); ++i) {
+        arrpush(dsts, params[i]);
+        dsts[i].position += base;
+    }
+    bind_arguments(&body, dsts, params, args);
+    arrfree(dsts);
+
+    size_t len = arrlenu(callee->ops);
+    for (size_t i = 1; i < len; ++i) {
+        Op op = copy_op(callee->ops[i]);
+
+        if (op.type == RtReturn) {
+            arrpush(body, OpAssignLocal(result, returned_value(op.return_routine.ret, base)));
+            if (i + 1 < len) arrpush(body, OpJump(end));
+            continue;
+        }
+
+        Arg* slots[MAX_OP_ARGS + 1];
+        size_t count = op_args(&op, slots);
+        Arg* dst = op_dst(&op);
+        if (dst) slots[count++] = dst;
+        for (size_t j = 0; j < count; ++j) {
+            if (slots[j]->type == Position) slots[j]->position += base;
+        }
+
+        // Inside the caller the tail call has to come back to store its result
+        if (op.type == TailCall) {
+            op.type = RoutineCall;
+            arrpush(body, op);
+            arrpush(body, OpAssignLocal(result, ((Arg) { .type = ReturnVal, .size = QWord })));
+            if (i + 1 < len) arrpush(body, OpJump(end));
+            continue;
+        }
+
+        switch (op.type) {
+            case Label: op.label.index = renamed_label(&labels, op.label.index); break;
+            case Jump: op.jump.label = renamed_label(&labels, op.jump.label); break;
+            case JumpIfNot: op.jump_if_not.label = renamed_label(&labels, op.jump_if_not.label); break;
+            case JumpIf: op.jump_if.label = renamed_label(&labels, op.jump_if.label); break;
+            default: break;
+        }
+
+        arrpush(body, op);
+    }
+
+    arrpush(body, OpLabel(end));
+    if (site.type == TailCall) arrpush(body, OpReturn(result));
+
+    Op* ops = NULL;
+    for (size_t i = 0; i < call; ++i) arrpush(ops, rt->ops[i]);
+    for (size_t i = 0; i < arrlenu(body); ++i) arrpush(ops, body[i]);
+    for (size_t i = call + 1; i < arrlenu(rt->ops); ++i) arrpush(ops, rt->ops[i]);
+
+    size_t inserted = arrlenu(body);
+    free_op(site);
+    arrfree(rt->ops);
+    arrfree(body);
+    hmfree(labels);
+    rt->ops = ops;
+    return inserted;
+}
+
+// A routine tail calling itself just rebinds its parameters and starts over
+// from the top. The arguments go through temporaries first since they may
+// read the parameters being overwritten.
+static size_t eliminate_tail_recursion(RoutineBody* rt) {
+    Arg* params = rt->ops[0].new_routine.args;
+    long entry = -1;
+    size_t eliminated = 0;
+
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        if (op->type != TailCall || strcmp(op->routine_call.name, routine_name(rt)) != 0) continue;
+        if (!binds_arguments(rt, op)) continue;
+
+        if (entry == -1) {
+            entry = new_label();
+            insert_op(&rt->ops, 1, OpLabel(entry));
+            i += 1;
+        }
+
+        Op call = rt->ops[i];
+        Arg* temps = NULL;
+        for (size_t j = 0; j < arrlenu(params); ++j) arrpush(temps, new_slot(rt, params[j]));
+
+        Op* ops = NULL;
+        bind_arguments(&ops, temps, params, call.routine_call.args);
+        for (size_t j = 0; j < arrlenu(params); ++j) arrpush(ops, OpAssignLocal(params[j], temps[j]));
+        arrpush(ops, OpJump(entry));
+
+        arrdel(rt->ops, i);
+        insert_ops(&rt->ops, i, ops, arrlenu(ops));
+        i += arrlenu(ops) - 1;
+
+        free_op(call);
+        arrfree(temps);
+        arrfree(ops);
+        eliminated += 1;
+    }
+
+    return eliminated;
+}
+
+static bool is_self_call(RoutineBody* rt, Op* op) {
+    return is_call(op) && strcmp(op->routine_call.name, routine_name(rt)) == 0;
+}
+
+// call f(args); t = x op rax; ret t
+static bool is_accumulated_call(RoutineBody* rt, size_t index, BinaryOp* op) {
+    if (index + 2 >= arrlenu(rt->ops)) return false;
+
+    Op* call = &rt->ops[index];
+    Op* combine = &rt->ops[index + 1];
+    Op* ret = &rt->ops[index + 2];
+    if (call->type != RoutineCall || !is_self_call(rt, call) || !binds_arguments(rt, call)) return false;
+    if (combine->type != Binary || (combine->binop.op != Add && combine->binop.op != Mul)) return false;
+    if (ret->type != RtReturn || !same_slot(ret->return_routine.ret, combine->binop.offset_dst)) return false;
+
+    Arg lhs = combine->binop.lhs;
+    Arg rhs = combine->binop.rhs;
+    Arg other = lhs.type == ReturnVal ? rhs : lhs;
+    if ((lhs.type == ReturnVal) == (rhs.type == ReturnVal)) return false;
+    if (other.type != Value && other.type != Position) return false;
+
+    *op = combine->binop.op;
+    return true;
+}
+
+// ret x op f(args), with op associative and commutative, is computed
+// bottom up in an accumulator instead: the routine becomes a loop that
+// folds every x into it and every other return folds its value in last.
+// Modular arithmetic keeps the low bits the same whatever the grouping,
+// and those are the only bits the original computation defined.
+static size_t introduce_accumulator(RoutineBody* rt) {
+    analyze_routine(rt);
+    for (size_t i = 0; i < hmlenu(rt->slots); ++i) {
+        if (rt->escaped[i]) return 0;
+    }
+
+    size_t sites = 0;
+    BinaryOp op = Add;
+
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        Op* current = &rt->ops[i];
+        BinaryOp site_op = Add;
+
+        if (current->type == TailCall) return 0;
+        if (is_self_call(rt, current)) {
+            if (!is_accumulated_call(rt, i, &site_op) || (sites > 0 && site_op != op)) return 0;
+            op = site_op;
+            sites += 1;
+            i += 2;
+            continue;
+        }
+
+        if (current->type == RtReturn && current->return_routine.ret.type == ReturnVal) return 0;
+    }
+
+    if (sites == 0) return 0;
+
+    Arg wide = { .type = Position, .size = QWord };
+    Arg acc = new_slot(rt, wide);
+    Arg result = new_slot(rt, wide);
+    Arg identity = { .type = Value, .size = QWord, .is_signed = true, .buffer = op == Mul ? 1 : 0 };
+    Arg* params = rt->ops[0].new_routine.args;
+
+    size_t entry = 0;
+    if (rt->ops[1].type == Label) entry = rt->ops[1].label.index;
+    else {
+        entry = new_label();
+        insert_op(&rt->ops, 1, OpLabel(entry));
+    }
+    insert_op(&rt->ops, 1, OpAssignLocal(acc, identity));
+
+    Op* ops = NULL;
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        Op* current = &rt->ops[i];
+        BinaryOp site_op = Add;
+
+        if (is_self_call(rt, current) && is_accumulated_call(rt, i, &site_op)) {
+            Op combine = rt->ops[i + 1];
+            if (combine.binop.lhs.type == ReturnVal) combine.binop.lhs = acc;
+            else combine.binop.rhs = acc;
+            combine.binop.offset_dst = acc;
+            arrpush(ops, combine);
+
+            Arg* temps = NULL;
+            for (size_t j = 0; j < arrlenu(params); ++j) arrpush(temps, new_slot(rt, params[j]));
+            bind_arguments(&ops, temps, params, current->routine_call.args);
+            for (size_t j = 0; j < arrlenu(params); ++j) arrpush(ops, OpAssignLocal(params[j], temps[j]));
+            arrpush(ops, OpJump(entry));
+
+            free_op(rt->ops[i]);
+            free_op(rt->ops[i + 2]);
+            arrfree(temps);
+            i += 2;
+            continue;
+        }
+
+        if (current->type == RtReturn) {
+            arrpush(ops, OpAssignLocal(result, returned_value(current->return_routine.ret, 0)));
+            arrpush(ops, OpBinary(result, op, acc, result));
+            arrpush(ops, OpReturn(result));
+            free_op(*current);
+            continue;
+        }
+
+        arrpush(ops, *current);
+    }
+
+    // The routine was copied before the temporaries were allocated
+    ops[0].new_routine.bytes = rt->ops[0].new_routine.bytes;
+    arrfree(rt->ops);
+    rt->ops = ops;
+    return sites;
+}
+
+// The bytes of a string literal up to the terminator a C library function
+// stops at, or NULL when the arg is not a literal
+static char* literal_bytes(Arg arg, size_t* length) {
+    if (arg.type != Offset) return NULL;
+
+    const char* raw = get_data()[arg.position].string;
+    char* bytes = malloc(strlen(raw) + 1);
+    long count = decode_string(raw, bytes);
+    if (count < 0) {
+        free(bytes);
+        return NULL;
+    }
+
+    *length = 0;
+    while (*length < (size_t)count && bytes[*length] != '\0') *length += 1;
+    return bytes;
+}
+
+// Written back the way the lexer keeps literals, anything that is not
+// printable as an octal escape
+static char* encode_string(const char* bytes, size_t length) {
+    String_Builder sb = {0};
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char c = bytes[i];
+        if (isprint(c) && c != '\\' && c != '"') sb_appendf(&sb, "%c", c);
+        else sb_appendf(&sb, "\\%03o", c);
+    }
+    sb_append_null(&sb);
+    return sb.items;
+}
+
+static void retarget_call(Op* call, const char* name, Arg arg) {
+    free(call->routine_call.name);
+    call->routine_call.name = strdup(name);
+    arrfree(call->routine_call.args);
+    arrpush(call->routine_call.args, arg);
+}
+
+// printf("text\n")     ->  puts("text")
+// printf("c")          ->  putchar('c')
+// printf("%s\n", s)    ->  puts(s)
+// printf("%c", c)      ->  putchar(c)
+//
+// None of them parses a format and they write to stdout through the same
+// buffer, so the output stays in order. What they return is not the count
+// printf does, so nothing may read it.
+static bool simplify_printf(Op* call, const char* format, size_t length) {
+    Arg* args = call->routine_call.args;
+    size_t count = arrlenu(args);
+
+    if (count == 1 && memchr(format, '%', length) == NULL) {
+        if (length == 1) {
+            retarget_call(call, "putchar", (Arg) { .type = Value, .size = DWord, .is_signed = true, .buffer = (uint8_t)format[0] });
+            return true;
+        }
+
+        if (length < 2 || format[length - 1] != '\n') return false;
+        size_t text = push_string(encode_string(format, length - 1));
+        retarget_call(call, "puts", (Arg) { .type = Offset, .size = QWord, .position = text });
+        return true;
+    }
+
+    if (count == 2 && length == 3 && memcmp(format, "%s\n", 3) == 0) {
+        retarget_call(call, "puts", args[1]);
+        return true;
+    }
+
+    if (count == 2 && length == 2 && memcmp(format, "%c", 2) == 0) {
+        retarget_call(call, "putchar", args[1]);
+        return true;
+    }
+
+    return false;
+}
+
+// C library calls the routine makes on string literals, known by name like
+// the codegen knows printf. strlen of a literal is a constant, and printf
+// with a format that has nothing to convert does not need to parse it.
+static size_t simplify_library_calls(RoutineBody* rt) {
+    size_t simplified = 0;
+
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        if (op->type != RoutineCall || arrlenu(op->routine_call.args) == 0) continue;
+
+        const char* name = op->routine_call.name;
+        size_t length = 0;
+        char* bytes = find_routine(name) == -1 ? literal_bytes(op->routine_call.args[0], &length) : NULL;
+        if (bytes == NULL) continue;
+
+        if (strcmp(name, "strlen") == 0 && arrlenu(op->routine_call.args) == 1) {
+            replace_return_value(rt, i + 1, (Arg) { .type = Value, .size = QWord, .buffer = length });
+            free_op(*op);
+            arrdel(rt->ops, i);
+            i -= 1;
+            simplified += 1;
+        } else if (strcmp(name, "printf") == 0 && !return_value_read(rt, i + 1)) {
+            simplified += simplify_printf(op, bytes, length);
+        }
+
+        free(bytes);
+    }
+
+    return simplified;
+}
+
+// x = *(base + i * size) narrowed to the element, the way indexing an array
+// compiles. Bytes are indexed without the scaling.
+typedef struct {
+    size_t start;
+    size_t address;
+    Arg base;
+    Arg element;
+} ElementLoad;
+
+static size_t match_element_load(RoutineBody* rt, size_t* defs, size_t index, size_t end, Arg var, ElementLoad* load) {
+    if (index >= end) return 0;
+
+    Op* scale = &rt->ops[index];
+    size_t size = 1;
+    Arg offset = var;
+    *load = (ElementLoad) { .start = index };
+
+    if (scale->type == Binary && (scale->binop.op == Mul || scale->binop.op == LSh) && scale->binop.rhs.type == Value) {
+        int64_t amount = scale->binop.rhs.buffer;
+        if (!same_slot(scale->binop.lhs, var) || scale->binop.offset_dst.size != QWord) return 0;
+        if (scale->binop.op == LSh) amount = amount >= 1 && amount <= 3 ? 1 << amount : 0;
+        if (amount != 2 && amount != 4 && amount != 8) return 0;
+        size = amount;
+        offset = scale->binop.offset_dst;
+        index += 1;
+    }
+
+    if (index + 1 >= end) return 0;
+
+    Op* address = &rt->ops[index];
+    Op* deref = &rt->ops[index + 1];
+    if (address->type != Binary || address->binop.op != Add || address->binop.offset_dst.size != QWord) return 0;
+    if (deref->type != Unary || deref->unary.op != Deref || !same_slot(deref->unary.arg, address->binop.offset_dst)) return 0;
+
+    Arg lhs = address->binop.lhs;
+    Arg rhs = address->binop.rhs;
+    if (same_slot(lhs, offset) == same_slot(rhs, offset)) return 0;
+
+    load->address = index;
+    load->base = same_slot(lhs, offset) ? rhs : lhs;
+    load->element = deref->unary.offset_dst;
+    if (load->base.size != QWord || !is_loop_constant(rt, defs, load->base)) return 0;
+
+    size_t next = index + 2;
+    if (next < end && rt->ops[next].type == AssignLocal && same_slot(rt->ops[next].assign_loc.arg, load->element)) {
+        load->element = rt->ops[next].assign_loc.offset_dst;
+        next += 1;
+    }
+
+    return (size_t)1 << load->element.size == size ? next - load->start : 0;
+}
+
+// i = i + 1; g = i < n; if (g) goto header
+// The counter is compared at its own width and signedness, which keeps it
+// from wrapping around before n and the addresses it makes contiguous.
+static Induction* match_loop_bound(RoutineBody* rt, size_t* defs, Induction* ivs, size_t at, size_t header) {
+    Induction* iv = NULL;
+    for (size_t i = 0; i < arrlenu(ivs); ++i) {
+        if (ivs[i].update == at && ivs[i].step == 1) iv = &ivs[i];
+    }
+
+    Op* bound = &rt->ops[at + 1];
+    Op* back = &rt->ops[at + 2];
+    if (iv == NULL || back->type != JumpIf || back->jump_if.label != rt->ops[rt->blocks[header].start].label.index) return NULL;
+    if (bound->type != Binary || (bound->binop.op != Lt && bound->binop.op != ULt)) return NULL;
+    if (!same_slot(bound->binop.offset_dst, back->jump_if.arg) || !same_slot(bound->binop.lhs, iv->var)) return NULL;
+
+    Arg var = iv->var;
+    Arg limit = bound->binop.rhs;
+    if (var.size < DWord || limit.size != var.size) return NULL;
+    if (limit.type != Value && !is_loop_constant(rt, defs, limit)) return NULL;
+    if (var.size != QWord && var.is_signed == is_unsigned_comparison(bound->binop.op)) return NULL;
+    return iv;
+}
+
+// r = i < n ? n - i : 1, how many times the body runs from here on. It runs
+// once even when i starts at or past n.
+static Arg push_remaining_trips(RoutineBody* rt, Op bound, Op** ops) {
+    Arg var = bound.binop.lhs;
+    Arg remaining = new_slot(rt, var);
+    remaining.is_signed = false;
+
+    arrpush(*ops, bound);
+    arrpush(*ops, OpBinary(remaining, Sub, bound.binop.rhs, var));
+    arrpush(*ops, OpSelect(remaining, bound.binop.offset_dst, remaining, ((Arg) { .type = Value, .size = remaining.size, .buffer = 1 })));
+    return remaining;
+}
+
+// The loop goes away, so nothing it computes but the counter and the result
+// may be read once it is left, neither directly nor through a pointer
+static bool only_counter_live(RoutineBody* rt, size_t* defs, long counter, long result, size_t block) {
+    for (size_t slot = 0; slot < hmlenu(rt->slots); ++slot) {
+        if (defs[slot] == 0 || (long)slot == counter) continue;
+        if (rt->escaped[slot] || ((long)slot != result && bitset_test(rt->live_in[block], slot))) return false;
+    }
+
+    return true;
+}
+
+static Op library_call(const char* name, Arg* args, size_t count) {
+    Op call = OpRoutineCall(strdup(name), NULL);
+    for (size_t i = 0; i < count; ++i) arrpush(call.routine_call.args, args[i]);
+    return call;
+}
+
+static void replace_ops(RoutineBody* rt, size_t start, size_t end, Op* with) {
+    arrdeln(rt->ops, start, end - start);
+    insert_ops(&rt->ops, start, with, arrlenu(with));
+    arrfree(with);
+}
+
+// do { n = n + 1; c = *(p + n) } while (c != 0)  ->  n = n + 1 + strlen(p + n + 1)
+// The counter has to be a QWord, a narrower one would wrap around before
+// the terminator on a long enough string.
+static size_t string_length_idiom(RoutineBody* rt, Loop* loop, size_t* defs, Induction* ivs) {
+    Block block = rt->blocks[loop->header];
+    if (loop->header + 1 >= arrlenu(rt->blocks) || find_routine("strlen") != -1) return 0;
+
+    size_t start = block.start + 1;
+    size_t test_index = block.end - 2;
+    Op* test = &rt->ops[test_index];
+    Op* back = &rt->ops[block.end - 1];
+    if (test_index <= start || back->type != JumpIf || test->type != Binary || test->binop.op != Ne) return 0;
+    if (!same_slot(test->binop.offset_dst, back->jump_if.arg)) return 0;
+
+    Induction* iv = NULL;
+    for (size_t i = 0; i < arrlenu(ivs); ++i) {
+        if (ivs[i].update >= start && ivs[i].update < test_index) iv = &ivs[i];
+    }
+    if (iv == NULL || iv->step != 1 || iv->var.size != QWord) return 0;
+
+    bool bumped_first = iv->update == start;
+    size_t at = start + bumped_first;
+    ElementLoad load = {0};
+    size_t count = match_element_load(rt, defs, at, test_index, iv->var, &load);
+    if (count == 0 || load.element.size != Byte || at + count + !bumped_first != test_index) return 0;
+
+    Arg lhs = test->binop.lhs;
+    Arg rhs = test->binop.rhs;
+    Arg terminator = same_slot(lhs, load.element) ? rhs : lhs;
+    if (same_slot(lhs, load.element) == same_slot(rhs, load.element)) return 0;
+    if (terminator.type != Value || truncate_value(terminator.buffer, terminator.size, true) != 0) return 0;
+    if (!only_counter_live(rt, defs, slot_index(rt, iv->var), -1, loop->header + 1)) return 0;
+
+    Arg length = new_slot(rt, iv->var);
+    Arg address = rt->ops[load.address].binop.offset_dst;
+    Arg returned = { .type = ReturnVal, .size = QWord, .is_signed = true };
+
+    Op* with = NULL;
+    arrpush(with, library_call("strlen", &address, 1));
+    arrpush(with, OpAssignLocal(length, returned));
+    arrpush(with, OpBinary(iv->var, Add, iv->var, length));
+
+    for (size_t i = at + 1; i < at + count; ++i) free_op(rt->ops[i]);
+    free_op(rt->ops[test_index]);
+    free_op(rt->ops[test_index + 1]);
+
+    arrdeln(rt->ops, test_index, 2);
+    replace_ops(rt, at + 1, at + count, with);
+    return 1;
+}
+
+// do { if (*(p + i) == c) X; i = i + 1 } while (i < n)                 ->  memchr
+// do { if (*(a + i) != *(b + i)) X; i = i + 1 } while (i < n)          ->  memcmp
+//
+// The body runs once even when i starts at or past n, so that is what
+// the call is asked to look at then. memcmp does not say where the
+// mismatch is, so the counter must be dead in X for it.
+static size_t buffer_scan_idiom(RoutineBody* rt, Loop* loop, size_t* defs, Induction* ivs) {
+    if (arrlenu(loop->blocks) != 2) return 0;
+
+    size_t head = loop->header;
+    size_t latch = loop->blocks[0] == head ? loop->blocks[1] : loop->blocks[0];
+    Block header = rt->blocks[head];
+    Block block = rt->blocks[latch];
+    if (latch < head || latch + 1 >= arrlenu(rt->blocks)) return 0;
+
+    size_t at = block.start + (rt->ops[block.start].type == Label);
+    if (block.end - at != 3) return 0;
+
+    Induction* iv = match_loop_bound(rt, defs, ivs, at, head);
+    if (iv == NULL) return 0;
+
+    Arg var = iv->var;
+    ElementLoad loads[2] = {0};
+    size_t count = 0;
+    size_t test_index = header.end - 2;
+    size_t i = header.start + 1;
+
+    while (count < 2 && i < test_index) {
+        size_t used = match_element_load(rt, defs, i, test_index, var, &loads[count]);
+        if (used == 0 || loads[count].element.size != Byte) return 0;
+        i += used;
+        count += 1;
+    }
+
+    Op* test = &rt->ops[test_index];
+    Op* branch = &rt->ops[header.end - 1];
+    if (count == 0 || i != test_index || test->type != Binary || (test->binop.op != Eq && test->binop.op != Ne)) return 0;
+    if (branch->type != JumpIf && branch->type != JumpIfNot) return 0;
+
+    bool jumps_if = branch->type == JumpIf;
+    Arg cond = jumps_if ? branch->jump_if.arg : branch->jump_if_not.arg;
+    size_t target = hmget(rt->labels, jumps_if ? branch->jump_if.label : branch->jump_if_not.label);
+    if (!same_slot(cond, test->binop.offset_dst)) return 0;
+
+    Arg lhs = test->binop.lhs;
+    Arg rhs = test->binop.rhs;
+    bool search = count == 1;
+    Arg args[3] = { rt->ops[loads[0].address].binop.offset_dst };
+
+    if (search) {
+        Arg needle = same_slot(lhs, loads[0].element) ? rhs : lhs;
+        if (same_slot(lhs, loads[0].element) == same_slot(rhs, loads[0].element) || needle.size != Byte) return 0;
+        if (needle.type != Value && !is_loop_constant(rt, defs, needle)) return 0;
+        args[1] = needle;
+    } else {
+        bool paired = (same_slot(lhs, loads[0].element) && same_slot(rhs, loads[1].element)) || (same_slot(lhs, loads[1].element) && same_slot(rhs, loads[0].element));
+        if (!paired || same_slot(loads[0].element, loads[1].element)) return 0;
+        args[1] = rt->ops[loads[1].address].binop.offset_dst;
+    }
+
+    // memchr leaves the loop where the bytes match, memcmp where they differ
+    const char* name = search ? "memchr" : "memcmp";
+    bool hit_taken = (jumps_if == (test->binop.op == Eq)) == search;
+    size_t hit = hit_taken ? target : head + 1;
+    size_t miss = hit_taken ? head + 1 : target;
+    if (miss != latch || in_loop(loop, hit) || find_routine(name) != -1) return 0;
+
+    long counter = slot_index(rt, var);
+    if (!only_counter_live(rt, defs, counter, -1, latch + 1) || !only_counter_live(rt, defs, search ? counter : -1, -1, hit)) return 0;
+
+    Arg result = new_slot(rt, search ? args[0] : (Arg) { .size = DWord, .is_signed = true });
+    Arg found = new_slot(rt, (Arg) { .size = Byte });
+    Arg returned = { .type = ReturnVal, .size = QWord, .is_signed = true };
+    Arg zero = { .type = Value, .size = result.size, .buffer = 0 };
+
+    bool labeled = rt->ops[block.start].type == Label;
+    size_t miss_label = labeled ? rt->ops[block.start].label.index : new_label();
+
+    Op* header_ops = NULL;
+    Arg remaining = push_remaining_trips(rt, rt->ops[at + 1], &header_ops);
+    args[2] = remaining;
+
+    Op* latch_ops = NULL;
+    if (!labeled) arrpush(latch_ops, OpLabel(miss_label));
+    arrpush(latch_ops, OpBinary(var, Add, var, remaining));
+
+    for (size_t l = 0; l < count; ++l) arrpush(header_ops, rt->ops[loads[l].address]);
+    arrpush(header_ops, library_call(name, args, 3));
+    arrpush(header_ops, OpAssignLocal(result, returned));
+    arrpush(header_ops, OpBinary(found, Ne, result, zero));
+    arrpush(header_ops, OpJumpIfNot(miss_label, found));
+    if (search) arrpush(header_ops, OpBinary(var, Sub, result, loads[0].base));
+    if (hit_taken) arrpush(header_ops, OpJump(rt->ops[rt->blocks[hit].start].label.index));
+
+    free_op(rt->ops[at]);
+    free_op(rt->ops[at + 2]);
+    for (size_t j = header.start + 1; j < header.end; ++j) {
+        bool moved = false;
+        for (size_t l = 0; l < count; ++l) moved |= j == loads[l].address;
+        if (!moved) free_op(rt->ops[j]);
+    }
+
+    replace_ops(rt, at, block.end, latch_ops);
+    replace_ops(rt, header.start + 1, header.end, header_ops);
+    return 1;
+}
+
+static size_t recognize_idiom(RoutineBody* rt, Loop* loop, size_t* defs, Induction* ivs) {
+    return arrlenu(loop->blocks) == 1
+        ? string_length_idiom(rt, loop, defs, ivs)
+        : buffer_scan_idiom(rt, loop, defs, ivs);
+}
+
+// Rewrites one loop at a time and looks at the loops again after each
+// rewrite, since it leaves the blocks and slots of the routine stale
+static size_t rewrite_loops(RoutineBody* rt, size_t (*rewrite)(RoutineBody*, Loop*, size_t*, Induction*)) {
+    size_t rewritten = 0;
+
+    while (true) {
+        analyze_routine(rt);
+        Loop* loops = find_loops(rt);
+
+        size_t count = 0;
+        for (size_t i = 0; i < arrlenu(loops) && count == 0; ++i) {
+            Loop* loop = &loops[i];
+            if (rt->ops[rt->blocks[loop->header].start].type != Label) continue;
+
+            size_t slots = hmlenu(rt->slots);
+            size_t* defs = calloc(slots + 1, sizeof(size_t));
+            size_t* def_op = calloc(slots + 1, sizeof(size_t));
+            count_loop_defs(rt, loop, defs, def_op);
+
+            Induction* ivs = find_inductions(rt, defs, def_op);
+            count = rewrite(rt, loop, defs, ivs);
+
+            arrfree(ivs);
+            free(defs);
+            free(def_op);
+        }
+
+        free_loops(loops);
+        if (count == 0) break;
+        rewritten += count;
+    }
+
+    return rewritten;
+}
+
+// Loops walking a buffer a byte at a time are handed over to libc, which
+// goes through it a word or a vector at a time. There is no store through a
+// pointer in the language, so filling and copying loops cannot be written
+// and only the reading ones are looked for.
+static size_t loop_idiom_recognition(RoutineBody* rt) {
+    return rewrite_loops(rt, recognize_idiom);
+}
+
+// do { s = s + x; i = i + 1 } while (i < n)                   ->  Reduce s, Add
+// do { if (x == c) k = k + 1; i = i + 1 } while (i < n)       ->  Reduce k, Eq, c
+// do { if (x < m) m = x; i = i + 1 } while (i < n)            ->  Reduce m, Lt
+// do { if (x > m) m = x; i = i + 1 } while (i < n)            ->  Reduce m, Gt
+//
+// where x = *(p + i * size). Only the element types the codegen has vector
+// instructions for are taken: bytes and 32 and 64-bit words are summed and
+// counted, unsigned bytes and signed 32-bit words are compared.
+static bool vector_reduction(BinaryOp op, Arg element) {
+    switch (op) {
+        case Add: return element.size != Word && (element.size != Byte || !element.is_signed);
+        case Eq: return element.size != Word;
+        case Lt:
+        case Gt: return (element.size == Byte && !element.is_signed) || (element.size == DWord && element.is_signed);
+        default: return false;
+    }
+}
+
+static size_t vectorize_loop(RoutineBody* rt, Loop* loop, size_t* defs, Induction* ivs) {
+    size_t blocks = arrlenu(loop->blocks);
+    size_t head = loop->header;
+    size_t latch = head + blocks - 1;
+    if ((blocks != 1 && blocks != 3) || latch + 1 >= arrlenu(rt->blocks)) return 0;
+    for (size_t i = 0; i < blocks; ++i) {
+        if (loop->blocks[i] < head || loop->blocks[i] > latch) return 0;
+    }
+
+    Block header = rt->blocks[head];
+    Block last = rt->blocks[latch];
+    size_t at = last.end - 3;
+    if (last.end < header.start + 4) return 0;
+
+    Induction* iv = match_loop_bound(rt, defs, ivs, at, head);
+    if (iv == NULL) return 0;
+
+    ElementLoad load = {0};
+    size_t used = match_element_load(rt, defs, header.start + 1, header.end, iv->var, &load);
+    if (used == 0) return 0;
+
+    size_t next = header.start + 1 + used;
+    Arg x = load.element;
+    Arg acc = {0};
+    Arg needle = { .type = Value, .size = x.size, .is_signed = x.is_signed };
+    BinaryOp op = Add;
+
+    if (blocks == 1) {
+        Op* sum = &rt->ops[next];
+        if (next + 1 != at || sum->type != Binary || sum->binop.op != Add) return 0;
+
+        acc = sum->binop.offset_dst;
+        Arg lhs = sum->binop.lhs;
+        Arg rhs = sum->binop.rhs;
+        bool paired = (same_slot(lhs, acc) && same_slot(rhs, x)) || (same_slot(lhs, x) && same_slot(rhs, acc));
+        if (!paired || same_slot(acc, x)) return 0;
+    } else {
+        Block body = rt->blocks[head + 1];
+        Op* test = &rt->ops[next];
+        Op* branch = &rt->ops[next + 1];
+        Op* update = &rt->ops[body.start];
+        if (next + 2 != header.end || body.end != body.start + 1) return 0;
+        if (rt->ops[last.start].type != Label || at != last.start + 1) return 0;
+        if (test->type != Binary || !is_comparison(test->binop.op)) return 0;
+        if (branch->type != JumpIf && branch->type != JumpIfNot) return 0;
+
+        // The body runs when the test holds if it is branched over otherwise
+        bool updates_if = branch->type == JumpIfNot;
+        Arg cond = updates_if ? branch->jump_if_not.arg : branch->jump_if.arg;
+        size_t target = updates_if ? branch->jump_if_not.label : branch->jump_if.label;
+        if (!same_slot(cond, test->binop.offset_dst) || target != rt->ops[last.start].label.index) return 0;
+
+        Arg lhs = test->binop.lhs;
+        Arg rhs = test->binop.rhs;
+        if (same_slot(lhs, x) == same_slot(rhs, x)) return 0;
+        Arg other = same_slot(lhs, x) ? rhs : lhs;
+
+        if (update->type == Binary && update->binop.op == Add) {
+            acc = update->binop.offset_dst;
+            Arg one = update->binop.rhs;
+            if (!same_slot(update->binop.lhs, acc) || one.type != Value || one.buffer != 1) return 0;
+            if (test->binop.op != (updates_if ? Eq : Ne) || other.size != x.size) return 0;
+            if (other.type != Value && !is_loop_constant(rt, defs, other)) return 0;
+            needle = other;
+            op = Eq;
+        } else if (update->type == AssignLocal && same_slot(update->assign_loc.arg, x)) {
+            acc = update->assign_loc.offset_dst;
+            BinaryOp compare = test->binop.op;
+            bool below = compare == Lt || compare == Le || compare == ULt || compare == ULe;
+            bool above = compare == Gt || compare == Ge || compare == UGt || compare == UGe;
+            if ((!below && !above) || !same_slot(other, acc) || same_slot(acc, x)) return 0;
+            if (acc.size != x.size || acc.is_signed != x.is_signed || is_unsigned_comparison(compare) == x.is_signed) return 0;
+            op = (below == same_slot(lhs, x)) == updates_if ? Lt : Gt;
+        } else {
+            return 0;
+        }
+    }
+
+    long counter = slot_index(rt, iv->var);
+    long result = slot_index(rt, acc);
+    if (result == -1 || result == counter || !vector_reduction(op, x)) return 0;
+    if (!only_counter_live(rt, defs, counter, result, latch + 1)) return 0;
+
+    Arg var = iv->var;
+    Arg address = rt->ops[load.address].binop.offset_dst;
+
+    Op* with = NULL;
+    Arg remaining = push_remaining_trips(rt, rt->ops[at + 1], &with);
+    for (size_t i = load.start; i <= load.address; ++i) arrpush(with, rt->ops[i]);
+    arrpush(with, OpReduce(acc, op, acc, address, remaining, needle, x.size, x.is_signed));
+    arrpush(with, OpBinary(var, Add, var, remaining));
+
+    for (size_t i = header.start + 1; i < last.end; ++i) {
+        bool moved = i == at + 1 || (i >= load.start && i <= load.address);
+        if (!moved) free_op(rt->ops[i]);
+    }
+
+    replace_ops(rt, header.start + 1, last.end, with);
+    return 1;
+}
+
+// Reductions over an array become a single Reduce, which the codegen runs
+// a vector at a time. Loops storing into an array cannot be written in the
+// language, so there is no aliasing between the elements to worry about.
+static size_t loop_vectorization(RoutineBody* rt) {
+    return rewrite_loops(rt, vectorize_loop);
+}
+
+#define EVAL_FUEL 100000
+#define MAX_EVAL_DEPTH 64
+
+// Whether the routine and everything it calls computes with nothing but its
+// arguments and its own slots. What is behind a pointer, the address of a
+// string and what a routine outside the program does are only known at run
+// time. A routine already on the path counts as pure, the rest of its body
+// is checked further up.
+static bool is_pure(size_t routine, bool* visited) {
+    if (visited[routine]) return true;
+    visited[routine] = true;
+
+    RoutineBody* rt = &program[routine];
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        Arg* args[MAX_OP_ARGS];
+        size_t count = op_args(op, args);
+        for (size_t j = 0; j < count; ++j) {
+            if (args[j]->type == Offset) return false;
+        }
+
+        switch (op->type) {
+            case AssignLocal:
+            case Binary:
+            case Select:
+            case RtReturn:
+            case Label:
+            case JumpIfNot:
+            case JumpIf:
+            case Jump: break;
+            case RoutineCall:
+            case TailCall: {
+                long callee = find_routine(op->routine_call.name);
+                if (callee == -1 || !is_pure(callee, visited)) return false;
+            } break;
+            default: return false;
+        }
+    }
+
+    return true;
+}
+
+// The slots of a routine being evaluated, laid out below its rbp like the
+// codegen does. The target is little endian like the host, so a narrow slot
+// is the low bytes of a value.
+typedef struct {
+    uint8_t* bytes;
+    size_t size;
+} Frame;
+
+typedef struct {
+    size_t fuel;
+    size_t depth;
+} Evaluation;
+
+static uint8_t* slot_bytes(Frame* frame, Arg slot) {
+    if (slot.type != Position || slot.position < ((size_t)1 << slot.size) || slot.position > frame->size) return NULL;
+    return frame->bytes + frame->size - slot.position;
+}
+
+// An arg read the way load_operand reads it, extended with its own signedness
+static bool read_arg(Frame* frame, int64_t rax, Arg arg, int64_t* value) {
+    switch (arg.type) {
+        case Value: *value = truncate_value(arg.buffer, arg.size, arg.is_signed); return true;
+        case ReturnVal: *value = truncate_value(rax, arg.size, arg.is_signed); return true;
+        case Position: {
+            uint8_t* bytes = slot_bytes(frame, arg);
+            if (bytes == NULL) return false;
+
+            int64_t stored = 0;
+            memcpy(&stored, bytes, (size_t)1 << arg.size);
+            *value = truncate_value(stored, arg.size, arg.is_signed);
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static bool write_slot(Frame* frame, Arg slot, int64_t value) {
+    uint8_t* bytes = slot_bytes(frame, slot);
+    if (bytes == NULL) return false;
+
+    memcpy(bytes, &value, (size_t)1 << slot.size);
+    return true;
+}
+
+// Mirrors the codegen for operands of any width, where fold_binary only
+// takes two of the same: arithmetic wraps at the width of the destination,
+// a comparison extends both sides to the wider one, a division works on at
+// least 32 bits and a shift on the wider of its lhs and destination
+static bool evaluate_binary(Op* op, int64_t a, int64_t b, int64_t* result) {
+    Arg lhs = op->binop.lhs;
+    Arg rhs = op->binop.rhs;
+    Arg dst = op->binop.offset_dst;
+    BinaryOp operation = op->binop.op;
+
+    if (is_comparison(operation)) {
+        Size size = max(lhs.size, rhs.size);
+        bool is_signed = !is_unsigned_comparison(operation);
+        *result = comparison_holds(operation, truncate_value(a, size, is_signed), truncate_value(b, size, is_signed));
+        return true;
+    }
+
+    if (is_division(operation)) {
+        Size size = dst.size < DWord ? DWord : dst.size;
+        bool is_signed = operation == Div || operation == Mod;
+        int64_t x = truncate_value(a, size, is_signed);
+        int64_t y = truncate_value(b, size, is_signed);
+        int64_t lowest = truncate_value((int64_t)((uint64_t)1 << ((8 << size) - 1)), size, true);
+
+        // Both trap at run time, which is left to happen there
+        if (y == 0 || (is_signed && x == lowest && y == -1)) return false;
+
+        if (is_signed) *result = operation == Div ? x / y : x % y;
+        else *result = operation == UDiv ? (int64_t)((uint64_t)x / (uint64_t)y) : (int64_t)((uint64_t)x % (uint64_t)y);
+        return true;
+    }
+
+    switch (operation) {
+        case Add: *result = (uint64_t)a + (uint64_t)b; return true;
+        case Sub: *result = (uint64_t)a - (uint64_t)b; return true;
+        case Mul: *result = (uint64_t)a * (uint64_t)b; return true;
+        case LSh:
+        case RSh: {
+            if (rhs.type != Value) return false;
+
+            Size size = max(lhs.size, dst.size);
+            uint64_t shift = truncate_value(rhs.buffer, rhs.size, false) & (size == QWord ? 63 : 31);
+            if (operation == LSh) *result = (uint64_t)a << shift;
+            else if (lhs.is_signed) *result = truncate_value(a, size, true) >> shift;
+            else *result = (uint64_t)truncate_value(a, size, false) >> shift;
+            return true;
+        }
+        default: return false;
+    }
+}
+
+// Mirrors routine_epilog, which zero extends what it returns into rax
+static bool returned_rax(Frame* frame, int64_t rax, Arg ret, int64_t* result) {
+    if (ret.type == ReturnVal) {
+        *result = rax;
+        return true;
+    }
+
+    if (ret.position == 0) {
+        *result = 0;
+        return true;
+    }
+
+    ret.is_signed = false;
+    return read_arg(frame, rax, ret, result);
+}
+
+static bool jump_to(RoutineBody* rt, size_t label, size_t* next) {
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        if (rt->ops[i].type != Label || rt->ops[i].label.index != label) continue;
+        *next = i + 1;
+        return true;
+    }
+
+    return false;
+}
+
+static bool evaluate_call(Op* call, Frame* frame, int64_t rax, Evaluation* eval, int64_t* result);
+
+// Runs the ops of the routine one by one, giving up on anything it cannot
+// tell the outcome of. Every op burns fuel, so an endless loop gives up too.
+static bool evaluate_routine(size_t routine, int64_t* values, Evaluation* eval, int64_t* result) {
+    if (eval->depth == MAX_EVAL_DEPTH) return false;
+
+    RoutineBody* rt = &program[routine];
+    Arg* params = rt->ops[0].new_routine.args;
+    size_t bytes = rt->ops[0].new_routine.bytes;
+    Frame frame = { calloc(bytes + 1, 1), bytes };
+    int64_t rax = 0;
+    bool ok = true;
+    bool returned = false;
+
+    for (size_t i = 0; i < arrlenu(params) && ok; ++i) ok = write_slot(&frame, params[i], values[i]);
+
+    eval->depth += 1;
+    size_t next = 1;
+    while (ok && !returned) {
+        if (next >= arrlenu(rt->ops) || eval->fuel == 0) {
+            ok = false;
+            break;
+        }
+
+        eval->fuel -= 1;
+        Op* op = &rt->ops[next++];
+        int64_t a = 0;
+        int64_t b = 0;
+        int64_t value = 0;
+
+        switch (op->type) {
+            case Label: break;
+            case AssignLocal: {
+                ok = read_arg(&frame, rax, op->assign_loc.arg, &a) && write_slot(&frame, op->assign_loc.offset_dst, a);
+            } break;
+            case Binary: {
+                ok = read_arg(&frame, rax, op->binop.lhs, &a) && read_arg(&frame, rax, op->binop.rhs, &b) &&
+                     evaluate_binary(op, a, b, &value) && write_slot(&frame, op->binop.offset_dst, value);
+            } break;
+            case Select: {
+                ok = read_arg(&frame, rax, op->select.cond, &a) &&
+                     read_arg(&frame, rax, a != 0 ? op->select.if_true : op->select.if_false, &b) &&
+                     write_slot(&frame, op->select.offset_dst, b);
+            } break;
+            case Jump: ok = jump_to(rt, op->jump.label, &next); break;
+            case JumpIf: {
+                ok = read_arg(&frame, rax, op->jump_if.arg, &a);
+                if (ok && a != 0) ok = jump_to(rt, op->jump_if.label, &next);
+            } break;
+            case JumpIfNot: {
+                ok = read_arg(&frame, rax, op->jump_if_not.arg, &a);
+                if (ok && a == 0) ok = jump_to(rt, op->jump_if_not.label, &next);
+            } break;
+            case RoutineCall: ok = evaluate_call(op, &frame, rax, eval, &rax); break;
+            case TailCall: {
+                ok = evaluate_call(op, &frame, rax, eval, &rax);
+                returned = true;
+            } break;
+            case RtReturn: {
+                ok = returned_rax(&frame, rax, op->return_routine.ret, &rax);
+                returned = true;
+            } break;
+            default: ok = false; break;
+        }
+    }
+    eval->depth -= 1;
+
+    free(frame.bytes);
+    *result = rax;
+    return ok;
+}
+
+// The arguments are bound the way bind_arguments binds them for the inliner
+static bool evaluate_call(Op* call, Frame* frame, int64_t rax, Evaluation* eval, int64_t* result) {
+    long callee = find_routine(call->routine_call.name);
+    if (callee == -1 || !binds_arguments(&program[callee], call)) return false;
+
+    Arg* args = call->routine_call.args;
+    Arg* params = program[callee].ops[0].new_routine.args;
+    int64_t values[X86_64_LINUX_CALL_REGISTERS_NUM] = {0};
+    if (arrlenu(args) > X86_64_LINUX_CALL_REGISTERS_NUM) return false;
+
+    for (size_t i = 0; i < arrlenu(args); ++i) {
+        if (!read_arg(frame, rax, call_argument(args[i], params[i]), &values[i])) return false;
+    }
+
+    return evaluate_routine(callee, values, eval, result);
+}
+
+static bool constant_arguments(Op* call) {
+    for (size_t i = 0; i < arrlenu(call->routine_call.args); ++i) {
+        if (call->routine_call.args[i].type != Value) return false;
+    }
+    return true;
+}
+
+// factorial(5) -> 120
+// A call to a pure routine of the program with nothing but constants for
+// arguments is run right here, and what it returns takes its place.
+static size_t evaluate_constant_calls(RoutineBody* rt) {
+    size_t evaluated = 0;
+
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        long callee = is_call(op) ? find_routine(op->routine_call.name) : -1;
+        if (callee == -1 || !constant_arguments(op)) continue;
+
+        bool* visited = calloc(arrlenu(program), sizeof(bool));
+        bool pure = is_pure(callee, visited);
+        free(visited);
+
+        Evaluation eval = { .fuel = EVAL_FUEL };
+        Frame none = {0};
+        int64_t value = 0;
+        if (!pure || !evaluate_call(op, &none, 0, &eval, &value)) continue;
+
+        // Only a mov takes a wider constant, anything else reads it from a slot
+        Arg result = { .type = Value, .size = QWord, .is_signed = true, .buffer = value };
+        Op* with = NULL;
+        if (!fits_int32(value)) {
+            Arg slot = new_slot(rt, (Arg) { .type = Position, .size = QWord });
+            arrpush(with, OpAssignLocal(slot, result));
+            result = slot;
+        }
+
+        if (op->type == TailCall) arrpush(with, OpReturn(result));
+        else replace_return_value(rt, i + 1, result);
+
+        size_t count = arrlenu(with);
+        free_op(*op);
+        replace_ops(rt, i, i + 1, with);
+        i = i + count - 1;
+        evaluated += 1;
+    }
+
+    return evaluated;
+}
+
+static bool is_select_operand(Arg arg) {
+    return arg.type == Position || arg.type == Value;
+}
+
+// An arm of a branch that only writes one slot and can neither fault nor
+// have a side effect, so it is fine to run it whatever the condition
+static bool is_select_arm(RoutineBody* rt, Op* op) {
+    switch (op->type) {
+        case AssignLocal: if (!is_select_operand(op->assign_loc.arg)) return false; break;
+        case Binary: if (op_may_trap(op)) return false; break;
+        default: return false;
+    }
+
+    return slot_index(rt, *op_dst(op)) != -1;
+}
+
+// What an arm leaves in its slot: a copy is read straight from its source,
+// anything else is computed into a fresh slot ahead of the select
+static Arg arm_value(RoutineBody* rt, Op** ops, Op arm) {
+    if (arm.type == AssignLocal) return arm.assign_loc.arg;
+
+    arm.binop.offset_dst = new_slot(rt, arm.binop.offset_dst);
+    arrpush(*ops, arm);
+    return arm.binop.offset_dst;
+}
+
+static bool has_single_pred(RoutineBody* rt, Op* op, size_t label) {
+    if (op->type != Label || op->label.index != label) return false;
+    return arrlenu(rt->blocks[hmget(rt->labels, label)].preds) == 1;
+}
+
+// Rewrites the branch starting at index into ops, returning how many ops it
+// replaced or 0 when it does not have one of the shapes below
+static size_t convert_branch(RoutineBody* rt, size_t index, Op** ops) {
+    Op* branch = &rt->ops[index];
+    size_t len = arrlenu(rt->ops);
+    Arg cond = {0};
+    size_t target = 0;
+
+    // The arm that falls through runs when a JumpIfNot condition holds and
+    // when a JumpIf one does not
+    bool swapped = branch->type == JumpIf;
+    switch (branch->type) {
+        case JumpIfNot: cond = branch->jump_if_not.arg; target = branch->jump_if_not.label; break;
+        case JumpIf: cond = branch->jump_if.arg; target = branch->jump_if.label; break;
+        default: return 0;
+    }
+
+    if (!is_select_operand(cond) || index + 2 >= len) return 0;
+    Op* first = &rt->ops[index + 1];
+
+    // if (c) ret a; ret b
+    if (first->type == RtReturn) {
+        size_t next = index + 2;
+        if (rt->ops[next].type == Jump) next += 1;
+        if (next + 1 >= len || !has_single_pred(rt, &rt->ops[next], target)) return 0;
+        if (rt->ops[next + 1].type != RtReturn) return 0;
+
+        Arg a = first->return_routine.ret;
+        Arg b = rt->ops[next + 1].return_routine.ret;
+        if (!is_select_operand(a) || !is_select_operand(b)) return 0;
+
+        Arg like = { .type = Position, .size = a.size == b.size ? a.size : QWord, .is_signed = a.is_signed };
+        Arg result = new_slot(rt, like);
+        arrpush(*ops, swapped ? OpSelect(result, cond, b, a) : OpSelect(result, cond, a, b));
+        arrpush(*ops, OpReturn(result));
+        return next + 2 - index;
+    }
+
+    if (!is_select_arm(rt, first)) return 0;
+    Arg dst = *op_dst(first);
+
+    // if (c) x = a; the label stays, whatever else jumps there lands
+    // after the select
+    Op* after = &rt->ops[index + 2];
+    if (after->type == Label && after->label.index == target) {
+        Arg a = arm_value(rt, ops, *first);
+        arrpush(*ops, swapped ? OpSelect(dst, cond, dst, a) : OpSelect(dst, cond, a, dst));
+        return 2;
+    }
+
+    // if (c) x = a; else x = b;
+    if (index + 5 >= len || rt->ops[index + 2].type != Jump) return 0;
+    if (!has_single_pred(rt, &rt->ops[index + 3], target)) return 0;
+
+    Op* second = &rt->ops[index + 4];
+    Op* end = &rt->ops[index + 5];
+    if (!is_select_arm(rt, second) || !same_slot(*op_dst(second), dst) || op_dst(second)->size != dst.size) return 0;
+    if (end->type != Label || end->label.index != rt->ops[index + 2].jump.label) return 0;
+
+    Arg a = arm_value(rt, ops, *first);
+    Arg b = arm_value(rt, ops, *second);
+    arrpush(*ops, swapped ? OpSelect(dst, cond, b, a) : OpSelect(dst, cond, a, b));
+    return 5;
+}
+
+static bool moves_before_comparison(RoutineBody* rt, size_t index, Op* arms, size_t count) {
+    Op* cmp = &rt->ops[index];
+    if (cmp->type != Binary || !is_comparison(cmp->binop.op)) return false;
+    if (!same_slot(cmp->binop.offset_dst, arms[count].select.cond)) return false;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (op_touches_slot(&arms[i], cmp->binop.offset_dst)) return false;
+    }
+
+    return true;
+}
+
+// Branches whose arms just pick a value for one variable, or return one,
+// become a Select, so the codegen can use cmov instead of a jump that
+// mispredicts whenever the condition depends on the data
+static size_t if_conversion(RoutineBody* rt) {
+    analyze_routine(rt);
+    size_t converted = 0;
+
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        Op* ops = NULL;
+        size_t replaced = convert_branch(rt, i, &ops);
+        if (replaced == 0) continue;
+
+        for (size_t j = 0; j < replaced; ++j) free_op(rt->ops[i + j]);
+        arrdeln(rt->ops, i, replaced);
+
+        // The arms go ahead of the comparison feeding the select, so the
+        // two stay next to each other and the codegen can use its flags
+        size_t select = 0;
+        while (ops[select].type != Select) select += 1;
+        if (select > 0 && moves_before_comparison(rt, i - 1, ops, select)) {
+            insert_op(&ops, select, rt->ops[i - 1]);
+            arrdel(rt->ops, i - 1);
+            i -= 1;
+        }
+
+        insert_ops(&rt->ops, i, ops, arrlenu(ops));
+        i += arrlenu(ops) - 1;
+
+        arrfree(ops);
+        converted += 1;
+    }
+
+    return converted;
+}
+
+static size_t* jump_label(Op* op) {
+    switch (op->type) {
+        case Jump: return &op->jump.label;
+        case JumpIfNot: return &op->jump_if_not.label;
+        case JumpIf: return &op->jump_if.label;
+        default: return NULL;
+    }
+}
+
+static bool label_follows(RoutineBody* rt, size_t index, size_t label) {
+    for (size_t i = index + 1; i < arrlenu(rt->ops) && rt->ops[i].type == Label; ++i) {
+        if (rt->ops[i].label.index == label) return true;
+    }
+    return false;
+}
+
+// The first op that runs once a jump lands on the label
+static Op* op_at_label(RoutineBody* rt, size_t label) {
+    long block = hmgeti(rt->labels, label);
+    if (block == -1) return NULL;
+
+    size_t i = rt->blocks[rt->labels[block].value].start;
+    while (i < arrlenu(rt->ops) && rt->ops[i].type == Label) i += 1;
+    return i < arrlenu(rt->ops) ? &rt->ops[i] : NULL;
+}
+
+// Follows a chain of labels that only jump again. Jumps going around in a
+// circle are an empty endless loop and are left as they are
+static bool final_label(RoutineBody* rt, size_t label, size_t* final) {
+    for (size_t hops = 0; hops <= arrlenu(rt->blocks); ++hops) {
+        Op* first = op_at_label(rt, label);
+        if (!first || first->type != Jump) {
+            *final = label;
+            return true;
+        }
+        label = first->jump.label;
+    }
+
+    return false;
+}
+
+static size_t thread_jumps(RoutineBody* rt) {
+    analyze_routine(rt);
+    size_t threaded = 0;
+
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        size_t* label = jump_label(&rt->ops[i]);
+        size_t final = 0;
+        if (!label || !final_label(rt, *label, &final) || final == *label) continue;
+
+        *label = final;
+        threaded += 1;
+    }
+
+    return threaded;
+}
+
+// jmp .in_N; .in_N: and the same with a conditional jump, whose condition
+// is a slot or a value and has nothing to run
+static size_t remove_jumps_to_next(RoutineBody* rt) {
+    bool* marked = calloc(arrlenu(rt->ops), sizeof(bool));
+
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        size_t* label = jump_label(&rt->ops[i]);
+        if (label && label_follows(rt, i, *label)) marked[i] = true;
+    }
+
+    size_t removed = remove_marked_ops(rt, marked);
+    free(marked);
+    return removed;
+}
+
+// if (!c) goto a; goto b; a: -> if (c) goto b; a:
+static size_t invert_branches_over_jumps(RoutineBody* rt) {
+    size_t inverted = 0;
+
+    for (size_t i = 1; i + 1 < arrlenu(rt->ops); ++i) {
+        Op* branch = &rt->ops[i];
+        Op* jump = &rt->ops[i + 1];
+        if (jump->type != Jump) continue;
+
+        switch (branch->type) {
+            case JumpIfNot: {
+                if (!label_follows(rt, i + 1, branch->jump_if_not.label)) continue;
+                *branch = OpJumpIf(jump->jump.label, branch->jump_if_not.arg);
+            } break;
+            case JumpIf: {
+                if (!label_follows(rt, i + 1, branch->jump_if.label)) continue;
+                *branch = OpJumpIfNot(jump->jump.label, branch->jump_if.arg);
+            } break;
+            default: continue;
+        }
+
+        arrdel(rt->ops, i + 1);
+        inverted += 1;
+    }
+
+    return inverted;
+}
+
+// Code after a return or a jump that no label leads back to, and blocks
+// only such code jumps to
+static size_t remove_unreachable_blocks(RoutineBody* rt) {
+    analyze_routine(rt);
+    bool* marked = calloc(arrlenu(rt->ops), sizeof(bool));
+
+    for (size_t b = 0; b < arrlenu(rt->blocks); ++b) {
+        if (rt->reachable[b]) continue;
+        for (size_t i = rt->blocks[b].start; i < rt->blocks[b].end; ++i) marked[i] = true;
+    }
+
+    size_t removed = remove_marked_ops(rt, marked);
+    free(marked);
+    return removed;
+}
+
+static bool is_unconditional(Op* op) {
+    return op->type == Jump || op->type == RtReturn || op->type == TailCall;
+}
+
+// A block reached only by a jump from further up, and which does not fall
+// through into the next one, is moved in place of that jump, so the path
+// runs straight through instead of jumping away and back
+static size_t move_jump_targets(RoutineBody* rt) {
+    analyze_routine(rt);
+
+    for (size_t b = 0; b < arrlenu(rt->blocks); ++b) {
+        Op* jump = &rt->ops[rt->blocks[b].end - 1];
+        if (jump->type != Jump || hmgeti(rt->labels, jump->jump.label) == -1) continue;
+
+        size_t target = hmget(rt->labels, jump->jump.label);
+        Block block = rt->blocks[target];
+        if (target <= b || arrlenu(block.preds) != 1 || block.preds[0] != b) continue;
+        if (!is_unconditional(&rt->ops[block.end - 1])) continue;
+
+        size_t at = rt->blocks[b].end - 1;
+        size_t count = block.end - block.start;
+        Op* moved = NULL;
+        for (size_t i = block.start; i < block.end; ++i) arrpush(moved, rt->ops[i]);
+
+        free_op(rt->ops[at]);
+        arrdeln(rt->ops, block.start, count);
+        arrdel(rt->ops, at);
+        insert_ops(&rt->ops, at, moved, count);
+
+        arrfree(moved);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Lays the blocks out so control falls through wherever it can: jumps to
+// jumps are threaded, jumps to the next op dropped, conditional branches
+// over a jump inverted and dead blocks removed, until nothing changes
+static size_t block_layout(RoutineBody* rt) {
+    size_t changes = 0;
+
+    while (true) {
+        size_t count = thread_jumps(rt);
+        count += remove_jumps_to_next(rt);
+        count += invert_branches_over_jumps(rt);
+        count += remove_unreachable_blocks(rt);
+        count += move_jump_targets(rt);
+
+        if (count == 0) break;
+        changes += count;
+    }
+
+    return changes;
+}
+
+static size_t remove_unused_labels(RoutineBody* rt) {
+    struct { size_t key; bool value; }* targets = NULL;
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        size_t* label = jump_label(&rt->ops[i]);
+        if (label) hmput(targets, *label, true);
+    }
+
+    bool* marked = calloc(arrlenu(rt->ops), sizeof(bool));
+    for (size_t i = 1; i < arrlenu(rt->ops); ++i) {
+        if (rt->ops[i].type == Label && hmgeti(targets, rt->ops[i].label.index) == -1) marked[i] = true;
+    }
+
+    size_t removed = remove_marked_ops(rt, marked);
+    free(marked);
+    hmfree(targets);
+    return removed;
+}
+
+static size_t inline_calls(RoutineBody* rt) {
+    size_t inlined = 0;
+
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        Op* op = &rt->ops[i];
+        if (!is_call(op)) continue;
+
+        long callee = find_routine(op->routine_call.name);
+        if (callee == -1 || !should_inline(rt, callee, op)) continue;
+
+        // The inlined body is skipped, its own calls were already
+        // considered when the callee was optimized
+        i += inline_call(rt, i, &program[callee]) - 1;
+        inlined += 1;
+    }
+
+    return inlined;
+}
+
+#define MAX_UNROLL_BODY 32
+#define FULL_UNROLL_TRIPS 16
+#define FULL_UNROLL_OPS 256
+
+// A loop made of a single block, closed by JumpIf(header, c) with c = i op n
+// comparing a counter against something the loop never changes
+typedef struct {
+    size_t label;
+    size_t exit_label;
+    size_t start;
+    size_t end;
+    size_t compare;
+    Induction iv;
+} CountedLoop;
+
+static bool find_counted_loop(RoutineBody* rt, Loop* loop, CountedLoop* counted) {
+    if (arrlenu(loop->blocks) != 1) return false;
+
+    Block block = rt->blocks[loop->header];
+    Op* last = &rt->ops[block.end - 1];
+    if (rt->ops[block.start].type != Label || last->type != JumpIf) return false;
+    if (last->jump_if.label != rt->ops[block.start].label.index) return false;
+    if (block.end >= arrlenu(rt->ops) || rt->ops[block.end].type != Label) return false;
+
+    long compare = -1;
+    for (size_t i = block.start; i < block.end - 1; ++i) {
+        Arg* dst = op_dst(&rt->ops[i]);
+        if (dst && same_slot(*dst, last->jump_if.arg)) compare = i;
+    }
+
+    if (compare == -1) return false;
+    Op* op = &rt->ops[compare];
+    if (op->type != Binary || !is_comparison(op->binop.op)) return false;
+
+    size_t slots = hmlenu(rt->slots);
+    size_t* defs = calloc(slots + 1, sizeof(size_t));
+    size_t* def_op = calloc(slots + 1, sizeof(size_t));
+    count_loop_defs(rt, loop, defs, def_op);
+
+    Induction* ivs = find_inductions(rt, defs, def_op);
+    Induction* iv = induction_of(ivs, op->binop.lhs);
+    Arg limit = op->binop.rhs;
+    bool found = iv && iv->update < (size_t)compare && ((limit.type == Value && fits_int32(limit.buffer)) || is_loop_constant(rt, defs, limit));
+
+    if (found) {
+        *counted = (CountedLoop) {
+            .label = rt->ops[block.start].label.index,
+            .exit_label = rt->ops[block.end].label.index,
+            .start = block.start + 1,
+            .end = block.end - 1,
+            .compare = compare,
+            .iv = *iv
+        };
+    }
+
+    arrfree(ivs);
+    free(defs);
+    free(def_op);
+    return found;
+}
+
+// The codegen extends both sides of a comparison with their own type to the
+// wider of the two widths, and reads them there as signed or unsigned
+// depending on the op. This is one side the way the test sees it
+static int64_t compared_value(int64_t value, Arg side, Size width, BinaryOp op) {
+    int64_t extended = truncate_value(value, side.size, side.is_signed);
+    return truncate_value(extended, width, !is_unsigned_comparison(op));
+}
+
+// The same as an operand whose assignment to a QWord extends it to that
+// value, which is not possible for a signed side of an unsigned comparison
+// that is extended twice
+static bool compared_operand(Arg side, Size width, BinaryOp op, Arg* operand) {
+    bool is_signed = !is_unsigned_comparison(op);
+    *operand = side;
+
+    if (side.size == width) {
+        operand->is_signed = is_signed;
+        return true;
+    }
+
+    return !side.is_signed || is_signed || width == QWord;
+}
+
+// Value the counter enters the loop with, when the straight line code
+// falling into it sets it to a constant
+static bool initial_value(RoutineBody* rt, size_t header, Arg var, int64_t* value) {
+    for (size_t i = header; i-- > 0;) {
+        Op* op = &rt->ops[i];
+        if (op->type == Label || op->type == NewRoutine) return false;
+
+        Arg* dst = op_dst(op);
+        if (dst == NULL || !same_slot(*dst, var)) continue;
+        if (op->type != AssignLocal || op->assign_loc.arg.type != Value) return false;
+
+        *value = truncate_value(op->assign_loc.arg.buffer, var.size, true);
+        return true;
+    }
+
+    return false;
+}
+
+static size_t trip_count(RoutineBody* rt, CountedLoop* counted) {
+    Op* op = &rt->ops[counted->compare];
+    Arg limit = op->binop.rhs;
+    Arg var = counted->iv.var;
+    BinaryOp compare = op->binop.op;
+    Size width = max(var.size, limit.size);
+
+    int64_t value = 0;
+    if (limit.type != Value) return 0;
+    if (!initial_value(rt, counted->start - 1, var, &value)) return 0;
+
+    int64_t bound = compared_value(limit.buffer, limit, width, compare);
+    size_t trips = 0;
+
+    do {
+        value = truncate_value((uint64_t)value + (uint64_t)counted->iv.step, var.size, true);
+        trips += 1;
+    } while (trips <= FULL_UNROLL_TRIPS && comparison_holds(compare, compared_value(value, var, width, compare), bound));
+
+    return trips > FULL_UNROLL_TRIPS ? 0 : trips;
+}
+
+static void unroll_completely(RoutineBody* rt, CountedLoop* counted, size_t trips) {
+    Op* ops = NULL;
+
+    for (size_t i = 0; i < counted->start; ++i) arrpush(ops, rt->ops[i]);
+    for (size_t t = 0; t < trips; ++t) {
+        for (size_t i = counted->start; i < counted->end; ++i) {
+            arrpush(ops, t == 0 ? rt->ops[i] : copy_op(rt->ops[i]));
+        }
+    }
+
+    free_op(rt->ops[counted->end]);
+    for (size_t i = counted->end + 1; i < arrlenu(rt->ops); ++i) arrpush(ops, rt->ops[i]);
+
+    arrfree(rt->ops);
+    rt->ops = ops;
+}
+
+static BinaryOp signed_comparison(BinaryOp op) {
+    switch (op) {
+        case ULt: return Lt;
+        case UGt: return Gt;
+        case ULe: return Le;
+        case UGe: return Ge;
+        default: return op;
+    }
+}
+
+// The body is repeated factor times under a single test that the counter
+// still has factor iterations to go, and the original loop is kept after it
+// to run whatever is left:
+//
+//     if (i + (factor - 1) * step < n) do { body * factor } while (i + (factor - 1) * step < n)
+//     if (i < n) do { body } while (i < n)
+//
+// The test is done on QWords so that moving the step to the other side
+// cannot overflow the width of the comparison, narrower values of either
+// signedness fit in a signed QWord. On unsigned QWords the moved limit is
+// clamped instead, at 0 for i < n and at the largest value for i > n, which
+// no counter passes.
+static bool unroll_partially(RoutineBody* rt, CountedLoop* counted, size_t factor) {
+    Op compare = rt->ops[counted->compare];
+    BinaryOp op = compare.binop.op;
+    Arg limit = compare.binop.rhs;
+    Arg var = counted->iv.var;
+    int64_t step = counted->iv.step;
+
+    BinaryOp wide_op = signed_comparison(op);
+    bool increasing = (wide_op == Lt || wide_op == Le) && step > 0;
+    bool decreasing = (wide_op == Gt || wide_op == Ge) && step < 0;
+    if (!increasing && !decreasing) return false;
+
+    int64_t distance = (int64_t)(factor - 1) * step;
+    if (!fits_int32(distance) || !fits_int32(distance - 1)) return false;
+
+    Size width = max(var.size, limit.size);
+    Arg counter = {0};
+    Arg bound = {0};
+    if (!compared_operand(var, width, op, &counter) || !compared_operand(limit, width, op, &bound)) return false;
+
+    bool clamped = width == QWord && is_unsigned_comparison(op);
+    if (clamped && op != ULt && op != UGt) return false;
+    if (width == QWord) wide_op = op;
+
+    Arg wide = { .type = Position, .size = QWord, .is_signed = !clamped };
+    Arg wide_limit = new_slot(rt, wide);
+    Arg wide_counter = new_slot(rt, wide);
+    Arg last_limit = new_slot(rt, wide);
+    Arg test = new_slot(rt, (Arg) { .type = Position, .size = Byte });
+    Arg offset = { .type = Value, .size = QWord, .is_signed = true, .buffer = distance };
+
+    size_t unrolled = new_label();
+    size_t remainder = new_label();
+
+    Op* ops = NULL;
+    arrpush(ops, OpAssignLocal(wide_limit, bound));
+    arrpush(ops, OpBinary(last_limit, Sub, wide_limit, offset));
+
+    if (clamped) {
+        // n - distance wraps below 0 when n < distance, n + distance above
+        // the largest value when n > largest - distance
+        Arg edge = { .type = Value, .size = QWord, .is_signed = true, .buffer = increasing ? distance : distance - 1 };
+        Arg clamp = { .type = Value, .size = QWord, .is_signed = true, .buffer = increasing ? 0 : -1 };
+        Arg wraps = new_slot(rt, (Arg) { .type = Position, .size = Byte });
+        arrpush(ops, OpBinary(wraps, op, wide_limit, edge));
+        arrpush(ops, OpSelect(last_limit, wraps, clamp, last_limit));
+    }
+
+    arrpush(ops, OpAssignLocal(wide_counter, counter));
+    arrpush(ops, OpBinary(test, wide_op, wide_counter, last_limit));
+    arrpush(ops, OpJumpIfNot(remainder, test));
+
+    arrpush(ops, OpLabel(unrolled));
+    for (size_t f = 0; f < factor; ++f) {
+        for (size_t i = counted->start; i < counted->end; ++i) arrpush(ops, copy_op(rt->ops[i]));
+    }
+    arrpush(ops, OpAssignLocal(wide_counter, counter));
+    arrpush(ops, OpBinary(test, wide_op, wide_counter, last_limit));
+    arrpush(ops, OpJumpIf(unrolled, test));
+
+    arrpush(ops, OpLabel(remainder));
+    arrpush(ops, compare);
+    arrpush(ops, OpJumpIfNot(counted->exit_label, compare.binop.offset_dst));
+
+    insert_ops(&rt->ops, counted->start - 1, ops, arrlenu(ops));
+    arrfree(ops);
+
+    hmput(unrolled_loops, unrolled, true);
+    return true;
+}
+
+static size_t unroll_loop(RoutineBody* rt, Loop* loop) {
+    CountedLoop counted = {0};
+    if (loop_preheader(rt, loop) == -1 || !find_counted_loop(rt, loop, &counted)) return 0;
+    if (hmgeti(unrolled_loops, counted.label) != -1) return 0;
+    hmput(unrolled_loops, counted.label, true);
+
+    size_t body = counted.end - counted.start;
+    size_t trips = trip_count(rt, &counted);
+    if (trips > 0 && body * trips <= FULL_UNROLL_OPS) {
+        unroll_completely(rt, &counted, trips);
+        return 1;
+    }
+
+    if (options.unroll < 2 || body > MAX_UNROLL_BODY) return 0;
+    return unroll_partially(rt, &counted, options.unroll) ? 1 : 0;
+}
+
+static size_t loop_unrolling(RoutineBody* rt) {
+    size_t unrolled = 0;
+
+    while (true) {
+        analyze_routine(rt);
+        Loop* loops = find_loops(rt);
+
+        size_t count = 0;
+        for (size_t i = 0; i < arrlenu(loops) && count == 0; ++i) {
+            count = unroll_loop(rt, &loops[i]);
+        }
+
+        free_loops(loops);
+        if (count == 0) break;
+        unrolled += count;
+    }
+
+    return unrolled;
+}
+
+static struct {
+    const char* name;
+    const char* unit;
+    Pass run;
+} passes[] = {
+    { "evaluate", "calls evaluated at compile time", evaluate_constant_calls },
+    { "inline", "calls inlined", inline_calls },
+    { "tailrec", "self tail calls turned into loops", eliminate_tail_recursion },
+    { "accumulate", "recursive calls accumulated", introduce_accumulator },
+    { "coalesce", "temporaries coalesced", coalesce_temporaries },
+    { "gvn", "redundant ops replaced", global_value_numbering },
+    { "copyprop", "uses propagated", copy_propagation },
+    { "libcalls", "library calls simplified", simplify_library_calls },
+    { "licm", "ops hoisted", loop_invariant_code_motion },
+    { "idiom", "loops replaced by library calls", loop_idiom_recognition },
+    { "vectorize", "loops vectorized", loop_vectorization },
+    { "ivsr", "induction ops reduced", strength_reduction },
+    { "unroll", "loops unrolled", loop_unrolling },
+    { "select", "branches turned into selects", if_conversion },
+    { "layout", "jumps threaded, removed or inverted and blocks moved", block_layout },
+    { "labels", "unused labels removed", remove_unused_labels },
+    { "dce", "ops removed", dead_code_elimination },
+};
+
+static RoutineBody* split_routines(Op* ops) {
+    RoutineBody* routines = NULL;
+
+    for (size_t i = 0; i < arrlenu(ops); ++i) {
+        if (ops[i].type == NewRoutine) arrpush(routines, (RoutineBody){0});
+        assert(arrlenu(routines) > 0 && "Operations outside of a routine");
+        arrpush(arrlast(routines).ops, ops[i]);
+    }
+
+    return routines;
+}
+
+static void mark_called_routines(size_t routine, bool* reached) {
+    if (reached[routine]) return;
+    reached[routine] = true;
+
+    RoutineBody* rt = &program[routine];
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        if (!is_call(&rt->ops[i])) continue;
+        long callee = find_routine(rt->ops[i].routine_call.name);
+        if (callee != -1) mark_called_routines(callee, reached);
+    }
+}
+
+// Only what main or an exported routine can end up calling is kept, the
+// rest is dropped before it gets optimized or lowered. A file without main
+// is not a program, so nothing can be told apart there
+static size_t remove_unreachable_routines() {
+    long entry = find_routine("main");
+    if (entry == -1) return 0;
+
+    bool* reached = calloc(arrlenu(program), sizeof(bool));
+    mark_called_routines(entry, reached);
+    for (size_t i = 0; i < arrlenu(program); ++i) {
+        if (program[i].ops[0].new_routine.exported) mark_called_routines(i, reached);
+    }
+
+    RoutineBody* kept = NULL;
+    size_t removed = 0;
+    for (size_t i = 0; i < arrlenu(program); ++i) {
+        if (reached[i]) {
+            arrpush(kept, program[i]);
+            continue;
+        }
+
+        for (size_t j = 0; j < arrlenu(program[i].ops); ++j) free_op(program[i].ops[j]);
+        free_analysis(&program[i]);
+        arrfree(program[i].ops);
+        removed += 1;
+    }
+
+    arrfree(program);
+    program = kept;
+    free(reached);
+    return removed;
+}
+
+
+#define MAX_PIPELINE_ROUNDS 4
+
+// Passes feed each other (value numbering leaves copies behind, propagating
+// them leaves dead stores), so the pipeline is repeated until it settles
+static void optimize_routine(RoutineBody* rt) {
+    size_t counts[ARRAY_LEN(passes)] = {0};
+
+    for (size_t round = 0; round < MAX_PIPELINE_ROUNDS; ++round) {
+        size_t changes = 0;
+
+        for (size_t i = 0; i < ARRAY_LEN(passes); ++i) {
+            size_t count = passes[i].run(rt);
+            counts[i] += count;
+            changes += count;
+        }
+
+        if (changes == 0) break;
+    }
+
+    if (!options.stats) return;
+    for (size_t i = 0; i < ARRAY_LEN(passes); ++i) {
+        nob_log(NOB_INFO, "%s: %s: %zu %s", passes[i].name, routine_name(rt), counts[i], passes[i].unit);
+    }
+}
+
+// Callees are optimized before their callers, so the inliner copies bodies
+// that are already cleaned up
+static void optimize_in_call_order(size_t routine, bool* done) {
+    if (done[routine]) return;
+    done[routine] = true;
+
+    RoutineBody* rt = &program[routine];
+    for (size_t i = 0; i < arrlenu(rt->ops); ++i) {
+        if (!is_call(&rt->ops[i])) continue;
+        long callee = find_routine(rt->ops[i].routine_call.name);
+        if (callee != -1) optimize_in_call_order(callee, done);
+    }
+
+    optimize_routine(rt);
+}
+
+void optimize_ops(Op** ops, OptimizerOptions opts) {
+    if (opts.level == 0) return;
+    options = opts;
+
+    // Labels are global in the generated assembly, so new ones have to come
+    // after every label of the program
+    for (size_t i = 0; i < arrlenu(*ops); ++i) {
+        if ((*ops)[i].type == Label) next_label = max(next_label, (*ops)[i].label.index + 1);
+    }
+
+    program = split_routines(*ops);
+    arrfree(*ops);
+    size_t removed = remove_unreachable_routines();
+
+    bool* done = calloc(arrlenu(program), sizeof(bool));
+    for (size_t i = 0; i < arrlenu(program); ++i) optimize_in_call_order(i, done);
+    free(done);
+
+    // Routines inlined at every call site are not called anymore
+    removed += remove_unreachable_routines();
+    if (options.stats) nob_log(NOB_INFO, "reachability: %zu unreachable routines removed", removed);
+
+    for (size_t i = 0; i < arrlenu(program); ++i) {
+        for (size_t j = 0; j < arrlenu(program[i].ops); ++j) arrpush(*ops, program[i].ops[j]);
+
+        free_analysis(&program[i]);
+        arrfree(program[i].ops);
+    }
+
+    arrfree(program);
+    hmfree(unrolled_loops);
+}
@@ -0,0 +1,18 @@
+#ifndef OPTIMIZER_HEADER
+#define OPTIMIZER_HEADER
+
+#include "compiler.h"
+
+#define NOB_STRIP_PREFIX
+#include "nob.h"
+
+typedef struct {
+    size_t level;
+    size_t unroll;
+    size_t inline_threshold;
+    bool stats;
+} OptimizerOptions;
+
+void optimize_ops(Op** ops, OptimizerOptions options);
+
+#endif
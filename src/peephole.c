@@ -0,0 +1,295 @@
+#include "peephole.h"
+#include "codegen.h"
+#include "stb_ds.h"
+#include <stdint.h>
+
+typedef bool (*Rule)(Instr** instrs, size_t i);
+
+static bool same_operand(Operand a, Operand b) {
+    if (a.type != b.type || a.size != b.size) return false;
+
+    switch (a.type) {
+        case NoOperand: return true;
+        case RegisterOperand: return a.reg == b.reg;
+        case MemoryOperand: return a.mem.base == b.mem.base && a.mem.disp == b.mem.disp;
+        case ImmediateOperand: return a.imm == b.imm;
+        case StringOperand: return a.index == b.index;
+        case SymbolOperand: return strcmp(a.name, b.name) == 0;
+        case LabelOperand: return a.label == b.label;
+        default: UNREACHABLE("Invalid Operand type");
+    }
+}
+
+static bool is_register(Operand operand) {
+    return operand.type == RegisterOperand;
+}
+
+static bool is_memory(Operand operand) {
+    return operand.type == MemoryOperand;
+}
+
+// mov [m], reg
+static bool is_store(Instr* instr) {
+    return instr->mnemonic == InstrMov && is_memory(instr->operands[0]) && is_register(instr->operands[1]);
+}
+
+static bool reads_flags(Mnemonic mnemonic) {
+    switch (mnemonic) {
+        case InstrSete:
+        case InstrSetne:
+        case InstrSetl:
+        case InstrSetle:
+        case InstrSetg:
+        case InstrSetge:
+        case InstrSetb:
+        case InstrSetbe:
+        case InstrSeta:
+        case InstrSetae:
+        case InstrCmovz:
+        case InstrCmovnz:
+        case InstrCmovl:
+        case InstrCmovle:
+        case InstrCmovg:
+        case InstrCmovge:
+        case InstrCmovb:
+        case InstrCmovbe:
+        case InstrCmova:
+        case InstrCmovae:
+        case InstrJz:
+        case InstrJnz:
+        case InstrJl:
+        case InstrJle:
+        case InstrJg:
+        case InstrJge:
+        case InstrJb:
+        case InstrJbe:
+        case InstrJa:
+        case InstrJae: return true;
+        default: return false;
+    }
+}
+
+static bool writes_flags(Mnemonic mnemonic) {
+    switch (mnemonic) {
+        case InstrAdd:
+        case InstrSub:
+        case InstrImul:
+        case InstrMul:
+        case InstrIdiv:
+        case InstrDiv:
+        case InstrNeg:
+        case InstrSal:
+        case InstrSar:
+        case InstrShr:
+        case InstrAnd:
+        case InstrXor:
+        case InstrCmp:
+        case InstrTest: return true;
+        default: return false;
+    }
+}
+
+// The codegen only sets flags right before the instruction that consumes
+// them, so they are never live across a label, a jump or a call
+static bool flags_dead_after(Instr* instrs, size_t i) {
+    for (size_t j = i + 1; j < arrlenu(instrs); ++j) {
+        Mnemonic mnemonic = instrs[j].mnemonic;
+        if (reads_flags(mnemonic)) return false;
+        if (writes_flags(mnemonic)) return true;
+
+        switch (mnemonic) {
+            case InstrLabel:
+            case InstrRoutine:
+            case InstrJmp:
+            case InstrCall:
+            case InstrRet: return true;
+            default: break;
+        }
+    }
+
+    return true;
+}
+
+// Instructions that only read their second operand, which can come from a
+// register just as well as from memory
+static bool reads_source(Instr* instr) {
+    if (instr->operands[2].type != NoOperand) return false;
+
+    switch (instr->mnemonic) {
+        case InstrMov:
+        case InstrMovsx:
+        case InstrMovsxd:
+        case InstrMovzx:
+        case InstrAdd:
+        case InstrSub:
+        case InstrImul:
+        case InstrCmp: return true;
+        default: return false;
+    }
+}
+
+// mov [m], reg; op x, [m] -> mov [m], reg; op x, reg
+static bool forward_store(Instr** instrs, size_t i) {
+    if (i + 1 >= arrlenu(*instrs)) return false;
+    Instr* store = &(*instrs)[i];
+    Instr* next = &(*instrs)[i + 1];
+
+    if (!is_store(store) || !reads_source(next)) return false;
+    if (!same_operand(store->operands[0], next->operands[1])) return false;
+
+    next->operands[1] = store->operands[1];
+    return true;
+}
+
+// mov reg, reg. A 32-bit move also clears the upper half, so it stays
+static bool drop_self_move(Instr** instrs, size_t i) {
+    Instr* instr = &(*instrs)[i];
+    if (instr->mnemonic != InstrMov || !is_register(instr->operands[0])) return false;
+    if (!same_operand(instr->operands[0], instr->operands[1])) return false;
+    if (instr->operands[0].size == DWord) return false;
+
+    arrdel(*instrs, i);
+    return true;
+}
+
+// mov reg, [m]; mov [m], reg -> mov reg, [m]
+static bool drop_round_trip(Instr** instrs, size_t i) {
+    if (i + 1 >= arrlenu(*instrs)) return false;
+    Instr* first = &(*instrs)[i];
+    Instr* store = &(*instrs)[i + 1];
+
+    if (first->mnemonic != InstrMov || !is_store(store)) return false;
+
+    Operand mem = store->operands[0];
+    Operand reg = store->operands[1];
+    if (mem.mem.base == reg.reg) return false;
+
+    bool loaded = same_operand(first->operands[0], reg) && same_operand(first->operands[1], mem);
+    bool stored = same_operand(first->operands[0], mem) && same_operand(first->operands[1], reg);
+    if (!loaded && !stored) return false;
+
+    arrdel(*instrs, i + 1);
+    return true;
+}
+
+// mov [m], x; mov [m], y -> mov [m], y
+static bool drop_dead_store(Instr** instrs, size_t i) {
+    if (i + 1 >= arrlenu(*instrs)) return false;
+    Instr* first = &(*instrs)[i];
+    Instr* second = &(*instrs)[i + 1];
+
+    if (first->mnemonic != InstrMov || second->mnemonic != InstrMov) return false;
+    if (!is_memory(first->operands[0])) return false;
+    if (!same_operand(first->operands[0], second->operands[0])) return false;
+
+    arrdel(*instrs, i);
+    return true;
+}
+
+// mov reg, 0 -> xor reg, reg, writing the 32-bit register clears the rest
+static bool zero_idiom(Instr** instrs, size_t i) {
+    Instr* instr = &(*instrs)[i];
+    Operand dst = instr->operands[0];
+    Operand src = instr->operands[1];
+
+    if (instr->mnemonic != InstrMov || !is_register(dst) || dst.size < DWord) return false;
+    if (src.type != ImmediateOperand || src.imm != 0) return false;
+    if (!flags_dead_after(*instrs, i)) return false;
+
+    Operand reg = OperandReg(dst.reg, DWord);
+    *instr = NewInstr(InstrXor, reg, reg);
+    return true;
+}
+
+// mov r64, imm -> mov r32, imm and movzx r64, m -> movzx r32, m, writing the
+// 32-bit register clears the upper half just the same without a REX prefix
+static bool implicit_zero_extension(Instr** instrs, size_t i) {
+    Instr* instr = &(*instrs)[i];
+    Operand dst = instr->operands[0];
+    Operand src = instr->operands[1];
+
+    if (!is_register(dst) || dst.size != QWord) return false;
+
+    switch (instr->mnemonic) {
+        case InstrMov: if (src.type != ImmediateOperand || src.imm < 0 || src.imm > UINT32_MAX) return false; break;
+        case InstrMovzx: break;
+        default: return false;
+    }
+
+    instr->operands[0].size = DWord;
+    if (src.type == ImmediateOperand) instr->operands[1].size = DWord;
+    return true;
+}
+
+// imul reg, reg, 2^k -> sal reg, k
+static bool multiply_by_power_of_two(Instr** instrs, size_t i) {
+    Instr* instr = &(*instrs)[i];
+    Operand dst = instr->operands[0];
+    Operand factor = instr->operands[2];
+
+    if (instr->mnemonic != InstrImul || factor.type != ImmediateOperand) return false;
+    if (!same_operand(dst, instr->operands[1])) return false;
+    if (factor.imm <= 0 || (factor.imm & (factor.imm - 1)) != 0) return false;
+    if (!flags_dead_after(*instrs, i)) return false;
+
+    int64_t shift = __builtin_ctzll(factor.imm);
+    if (shift >= 31) return false;
+
+    if (shift == 0) *instr = NewInstr(InstrMov, dst, dst);
+    else *instr = NewInstr(InstrSal, dst, OperandImm(shift, Byte));
+    return true;
+}
+
+// jmp .in_N; .in_N: -> .in_N:
+static bool drop_jump_to_next(Instr** instrs, size_t i) {
+    Instr* instr = &(*instrs)[i];
+    if (instr->mnemonic != InstrJmp || instr->operands[0].type != LabelOperand) return false;
+
+    for (size_t j = i + 1; j < arrlenu(*instrs) && (*instrs)[j].mnemonic == InstrLabel; ++j) {
+        if ((*instrs)[j].operands[0].label != instr->operands[0].label) continue;
+
+        arrdel(*instrs, i);
+        return true;
+    }
+
+    return false;
+}
+
+static struct {
+    const char* name;
+    const char* unit;
+    Rule apply;
+} rules[] = {
+    { "store-load", "reloads forwarded from a store", forward_store },
+    { "self-move", "moves to the same register removed", drop_self_move },
+    { "round-trip", "stores of an unchanged value removed", drop_round_trip },
+    { "dead-store", "overwritten stores removed", drop_dead_store },
+    { "zero", "zeroing moves turned into xor", zero_idiom },
+    { "zext", "64-bit moves turned into 32-bit ones", implicit_zero_extension },
+    { "mul-pow2", "multiplications turned into shifts", multiply_by_power_of_two },
+    { "jump-next", "jumps to the next instruction removed", drop_jump_to_next },
+};
+
+// A rewrite can expose another one right before it (forwarding a store
+// leaves a self move behind), so the list is scanned until nothing matches
+void peephole_optimize(Instr** instrs, bool stats) {
+    size_t counts[ARRAY_LEN(rules)] = {0};
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (size_t i = 0; i < arrlenu(*instrs); ++i) {
+            for (size_t r = 0; r < ARRAY_LEN(rules) && i < arrlenu(*instrs); ++r) {
+                if (!rules[r].apply(instrs, i)) continue;
+                counts[r] += 1;
+                changed = true;
+            }
+        }
+    }
+
+    if (!stats) return;
+    for (size_t r = 0; r < ARRAY_LEN(rules); ++r) {
+        nob_log(NOB_INFO, "peephole: %s: %zu %s", rules[r].name, counts[r], rules[r].unit);
+    }
+}
@@ -0,0 +1,8 @@
+#ifndef PEEPHOLE_HEADER
+#define PEEPHOLE_HEADER
+
+#include "codegen.h"
+
+void peephole_optimize(Instr** instrs, bool stats);
+
+#endif
@@ -5,6 +5,9 @@ const char* display_type(TokenType type) {
         case Eof: return "Eof";
         case ParseError: return "ParseError";
         case Routine: return "Routine";
+        case Inline: return "Inline";
+        case NoInline: return "NoInline";
+        case Export: return "Export";
         case Return: return "Return";
         case Identifier: return "Identifier";
         case SemiColon: return ";";
@@ -17,6 +20,7 @@ const char* display_type(TokenType type) {
         case Else: return "Else";
         case Comma: return ",";
         case Slash: return "/";
+        case Percent: return "%";
         case Equal: return "=";
         case EqualEqual: return "==";
         case ShiftRight: return ">>";
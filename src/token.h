@@ -19,6 +19,9 @@ typedef enum {
     While,
     Return,
     Routine,
+    Inline,
+    NoInline,
+    Export,
 
     VarTypei8,
     VarTypei16,
@@ -46,6 +49,7 @@ typedef enum {
     Minus,
     Star,
     Slash,
+    Percent,
     Ampersand,
 
     Identifier,